@@ -0,0 +1,129 @@
+#include "BarchImageProvider.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QRunnable>
+#include <QUrl>
+#include <QDebug>
+#include <atomic>
+#include <cstring>
+
+#include "barch.hpp"
+
+namespace {
+
+constexpr qsizetype kCacheBytes = 32 * 1024 * 1024;
+constexpr int kDefaultThumbSide = 64;
+constexpr int kMaxThreads = 2;
+
+class ThumbnailResponse : public QQuickImageResponse, public QRunnable
+{
+public:
+    ThumbnailResponse(const QString& path, const QSize& requestedSize, ThumbnailCache* cache)
+        : m_path(path), m_size(requestedSize), m_cache(cache)
+    {
+        setAutoDelete(false);
+        if (m_size.width() <= 0)
+            m_size.setWidth(kDefaultThumbSide);
+        if (m_size.height() <= 0)
+            m_size.setHeight(kDefaultThumbSide);
+    }
+
+    QQuickTextureFactory* textureFactory() const override
+    {
+        return QQuickTextureFactory::textureFactoryForImage(m_image);
+    }
+    QString errorString() const override { return m_error; }
+    void cancel() override { m_canceled = true; }
+
+    void run() override
+    {
+        if (!m_canceled)
+            load();
+        emit finished();
+    }
+
+private:
+    void load()
+    {
+        const QFileInfo fi(m_path);
+        const QString key = QStringLiteral("%1|%2|%3x%4")
+                                .arg(fi.absoluteFilePath())
+                                .arg(fi.lastModified().toMSecsSinceEpoch())
+                                .arg(m_size.width())
+                                .arg(m_size.height());
+        if (m_cache->find(key, m_image))
+            return;
+
+        QFile f(m_path);
+        if (!f.open(QIODevice::ReadOnly))
+        {
+            m_error = QStringLiteral("cannot open %1").arg(m_path);
+            return;
+        }
+        const QByteArray bytes = f.readAll();
+        if (m_canceled)
+            return;
+
+        try {
+            RawImageData thumb = barch::decodeThumbnail(reinterpret_cast<const std::uint8_t*>(bytes.constData()),
+                                                        static_cast<std::size_t>(bytes.size()),
+                                                        m_size.width(), m_size.height());
+            QImage img(thumb.width, thumb.height, QImage::Format_Grayscale8);
+            for (int y = 0; y < thumb.height; ++y)
+                std::memcpy(img.scanLine(y), thumb.data + y * thumb.width, thumb.width);
+            barch::freeImage(thumb);
+            m_image = img;
+            m_cache->insert(key, m_image);
+        } catch (const std::exception& e) {
+            qDebug() << "thumbnail:" << m_path << e.what();
+            m_error = QString::fromUtf8(e.what());
+        }
+    }
+
+    QString m_path;
+    QSize m_size;
+    ThumbnailCache* m_cache;
+    QImage m_image;
+    QString m_error;
+    std::atomic_bool m_canceled { false };
+};
+
+} // namespace
+
+ThumbnailCache::ThumbnailCache(qsizetype maxBytes)
+    : m_cache(maxBytes / 1024)
+{
+}
+
+bool ThumbnailCache::find(const QString& key, QImage& out)
+{
+    QMutexLocker locker(&m_lock);
+    // object() also marks the entry most recently used
+    if (const QImage* img = m_cache.object(key))
+    {
+        out = *img;
+        return true;
+    }
+    return false;
+}
+
+void ThumbnailCache::insert(const QString& key, const QImage& img)
+{
+    QMutexLocker locker(&m_lock);
+    m_cache.insert(key, new QImage(img), img.sizeInBytes() / 1024 + 1);
+}
+
+BarchImageProvider::BarchImageProvider()
+    : m_cache(kCacheBytes)
+{
+    m_pool.setMaxThreadCount(kMaxThreads);
+}
+
+QQuickImageResponse* BarchImageProvider::requestImageResponse(const QString& id, const QSize& requestedSize)
+{
+    const QString path = QUrl::fromPercentEncoding(id.toUtf8());
+    auto* response = new ThumbnailResponse(path, requestedSize, &m_cache);
+    m_pool.start(response);
+    return response;
+}
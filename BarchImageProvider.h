@@ -0,0 +1,36 @@
+#pragma once
+#include <QQuickAsyncImageProvider>
+#include <QThreadPool>
+#include <QCache>
+#include <QMutex>
+#include <QImage>
+#include <QString>
+
+// Size-bounded LRU of decoded previews. Keys carry the file mtime, so an
+// overwritten file simply misses and its old preview ages out.
+class ThumbnailCache
+{
+public:
+    explicit ThumbnailCache(qsizetype maxBytes);
+
+    bool find(const QString& key, QImage& out);
+    void insert(const QString& key, const QImage& img);
+
+private:
+    QMutex m_lock;
+    QCache<QString, QImage> m_cache; // cost in KB
+};
+
+// Serves image://barch/<percent-encoded path> with previews decoded directly
+// from the BARCH bitstream on a private thread pool.
+class BarchImageProvider : public QQuickAsyncImageProvider
+{
+public:
+    BarchImageProvider();
+
+    QQuickImageResponse* requestImageResponse(const QString& id, const QSize& requestedSize) override;
+
+private:
+    QThreadPool m_pool;
+    ThumbnailCache m_cache;
+};
@@ -0,0 +1,235 @@
+#include "BatchPipeline.h"
+#include "barch.hpp"
+#include "bmp_io.h"
+#include "image_ingest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+namespace batch
+{
+
+namespace {
+
+using Buffer = std::vector<std::uint8_t>;
+
+// Fixed set of reusable buffers; acquire() blocks while all are in flight.
+class BufferPool
+{
+public:
+    explicit BufferPool(std::size_t count) : m_free(count)
+    {
+        for (std::size_t i = 0; i < count; ++i)
+            m_free.push(Buffer());
+    }
+    Buffer acquire() { return std::move(*m_free.pop()); }
+    void release(Buffer buf) { m_free.push(std::move(buf)); }
+
+private:
+    BoundedQueue<Buffer> m_free;
+};
+
+// Counts tasks started on an executor so run() can wait for all of them.
+class TaskGroup
+{
+public:
+    void start(const Executor& exec, std::function<void()> fn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            ++m_running;
+        }
+        auto task = [this, fn = std::move(fn)]() {
+            fn();
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (--m_running == 0)
+                m_idle.notify_all();
+        };
+        if (exec)
+            exec(std::move(task));
+        else
+            std::thread(std::move(task)).detach();
+    }
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_idle.wait(lock, [this] { return m_running == 0; });
+    }
+
+private:
+    std::mutex m_lock;
+    std::condition_variable m_idle;
+    int m_running = 0;
+};
+
+struct Item
+{
+    const Job* job = nullptr;
+    Buffer bytes;
+    JobDone result;
+};
+
+} // namespace
+
+void readFile(const std::string& path, std::vector<std::uint8_t>& buf, stats::JobStats& st)
+{
+    stats::ScopedTimer t(st.readNs, "read", path);
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    if (!f)
+        throw std::runtime_error("pipeline: cannot open input");
+    const std::streamsize size = f.tellg();
+    if (size <= 0)
+        throw std::runtime_error("pipeline: empty input");
+    buf.resize(static_cast<std::size_t>(size));
+    f.seekg(0, std::ios::beg);
+    if (!f.read(reinterpret_cast<char*>(buf.data()), size))
+        throw std::runtime_error("pipeline: read failed");
+    st.bytesIn += buf.size();
+}
+
+void writeFile(const std::string& path, const std::vector<std::uint8_t>& buf, stats::JobStats& st)
+{
+    stats::ScopedTimer t(st.writeNs, "write", path);
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    if (!f)
+        throw std::runtime_error("pipeline: cannot open output");
+    f.write(reinterpret_cast<const char*>(buf.data()), static_cast<std::streamsize>(buf.size()));
+    if (!f)
+        throw std::runtime_error("pipeline: write failed");
+    st.bytesOut += buf.size();
+}
+
+void transcode(JobKind kind, const std::vector<std::uint8_t>& in, std::vector<std::uint8_t>& out,
+               stats::JobStats& st, const std::string& path, const barch::EncodeOptions& opt)
+{
+    RawImageData img;
+    if (kind == JobKind::Encode)
+    {
+        stats::ScopedTimer t(st.bmpNs, "image load", path);
+        img = decodeGrayImage(in.data(), in.size());
+    } else
+    {
+        stats::ScopedTimer t(st.codecNs, "decode", path);
+        img = opt.reference ? barch::decode(in.data(), in.size(), *opt.reference, &st.blocks)
+                            : barch::decode(in.data(), in.size(), &st.blocks);
+    }
+    st.pixels += std::uint64_t(img.width) * std::uint64_t(img.height);
+
+    try {
+        if (kind == JobKind::Encode)
+        {
+            stats::ScopedTimer t(st.codecNs, "encode", path);
+            barch::encodeTo(img, out, opt, &st.blocks);
+        } else
+        {
+            stats::ScopedTimer t(st.bmpNs, "bmp store", path);
+            encodeGrayBMP(img, out);
+        }
+    } catch (...) {
+        barch::freeImage(img);
+        throw;
+    }
+    barch::freeImage(img);
+}
+
+Pipeline::Pipeline(PipelineConfig cfg)
+    : m_cfg(std::move(cfg))
+{
+    if (m_cfg.computeThreads <= 0)
+        m_cfg.computeThreads = std::max(1u, std::thread::hardware_concurrency());
+    if (m_cfg.buffersPerStage <= 0)
+        m_cfg.buffersPerStage = m_cfg.computeThreads + 2;
+}
+
+void Pipeline::run(const std::vector<Job>& jobs)
+{
+    const std::size_t depth = static_cast<std::size_t>(m_cfg.buffersPerStage);
+    // Separate input and output sets: the writer never waits on a pool, so
+    // the reader filling every input buffer cannot starve the encoders.
+    BufferPool inBufs(depth);
+    BufferPool outBufs(depth);
+    BoundedQueue<Item> toCompute(depth);
+    BoundedQueue<Item> toWrite(depth);
+
+    TaskGroup tasks;
+    tasks.start(m_cfg.ioExecutor, [&] {
+        for (const Job& job : jobs)
+        {
+            Item it;
+            it.job = &job;
+            it.result.id = job.id;
+            if (m_cfg.skip && m_cfg.skip(job))
+            {
+                it.result.skipped = true;
+                toWrite.push(std::move(it));
+                continue;
+            }
+            it.bytes = inBufs.acquire();
+            try {
+                readFile(job.inPath, it.bytes, it.result.stats);
+                if (m_cfg.onRead)
+                    m_cfg.onRead(job, it.bytes);
+            } catch (const std::exception& e) {
+                it.result.error = e.what();
+            }
+            toCompute.push(std::move(it));
+        }
+        toCompute.close();
+    });
+
+    // Every worker runs eventually, even one queued behind others that has
+    // nothing left to pop; the last to leave ends the writer's input.
+    std::atomic_int workersLeft { m_cfg.computeThreads };
+    for (int i = 0; i < m_cfg.computeThreads; ++i)
+    {
+        tasks.start(m_cfg.computeExecutor, [&] {
+            while (std::optional<Item> it = toCompute.pop())
+            {
+                Buffer out = outBufs.acquire();
+                if (it->result.error.empty())
+                {
+                    try {
+                        transcode(it->job->kind, it->bytes, out, it->result.stats, it->job->inPath, m_cfg.encode);
+                    } catch (const std::exception& e) {
+                        it->result.error = e.what();
+                    }
+                }
+                inBufs.release(std::move(it->bytes));
+                it->bytes = std::move(out);
+                toWrite.push(std::move(*it));
+            }
+            if (--workersLeft == 0)
+                toWrite.close();
+        });
+    }
+
+    while (std::optional<Item> it = toWrite.pop())
+    {
+        if (!it->result.skipped && it->result.error.empty())
+        {
+            try {
+                if (m_cfg.sink)
+                {
+                    stats::ScopedTimer t(it->result.stats.writeNs, "write", it->job->outPath);
+                    m_cfg.sink(*it->job, it->bytes);
+                    it->result.stats.bytesOut += it->bytes.size();
+                } else
+                {
+                    writeFile(it->job->outPath, it->bytes, it->result.stats);
+                }
+            } catch (const std::exception& e) {
+                it->result.error = e.what();
+            }
+        }
+        if (!it->result.skipped)
+            outBufs.release(std::move(it->bytes));
+        if (m_cfg.done)
+            m_cfg.done(*it->job, it->result);
+    }
+    tasks.wait();
+}
+
+} // namespace batch
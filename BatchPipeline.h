@@ -0,0 +1,134 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "JobStats.h"
+
+namespace batch
+{
+
+// Blocking FIFO with a fixed capacity. close() wakes all waiters; pop()
+// then drains what is left and returns nullopt once empty.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(std::size_t capacity) : m_capacity(capacity ? capacity : 1) {}
+
+    void push(T item)
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_notFull.wait(lock, [this] { return m_items.size() < m_capacity || m_closed; });
+        m_items.push_back(std::move(item));
+        m_notEmpty.notify_one();
+    }
+
+    std::optional<T> pop()
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_notEmpty.wait(lock, [this] { return !m_items.empty() || m_closed; });
+        if (m_items.empty())
+            return std::nullopt;
+        T item = std::move(m_items.front());
+        m_items.pop_front();
+        m_notFull.notify_one();
+        return item;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_closed = true;
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+    }
+
+private:
+    std::mutex m_lock;
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+    std::deque<T> m_items;
+    std::size_t m_capacity;
+    bool m_closed = false;
+};
+
+enum class JobKind
+{
+    Encode, // BMP or PNG -> BARCH
+    Decode  // BARCH -> 8-bit BMP
+};
+
+struct Job
+{
+    std::size_t id = 0;
+    JobKind kind = JobKind::Encode;
+    std::string inPath;
+    std::string outPath;
+};
+
+struct JobDone
+{
+    std::size_t id = 0;
+    std::string error;
+    bool skipped = false;
+    stats::JobStats stats;
+};
+
+// Single-stage building blocks, shared with the per-file jobs. All throw
+// std::exception on failure; buffers are resized, not reallocated. Each
+// adds its time and volume to `st`; `path` only labels trace events.
+void readFile(const std::string& path, std::vector<std::uint8_t>& buf, stats::JobStats& st);
+void writeFile(const std::string& path, const std::vector<std::uint8_t>& buf, stats::JobStats& st);
+void transcode(JobKind kind, const std::vector<std::uint8_t>& in, std::vector<std::uint8_t>& out,
+               stats::JobStats& st, const std::string& path, const barch::EncodeOptions& opt = {});
+
+// Runs a stage loop on some thread and returns at once.
+using Executor = std::function<void(std::function<void()>)>;
+
+struct PipelineConfig
+{
+    int computeThreads = 0; // 0 = hardware concurrency
+    int buffersPerStage = 0; // 0 = computeThreads + 2
+    // Where the reader loop and the compute workers run, e.g. the caller's
+    // I/O and CPU thread pools. Unset means a dedicated std::thread each.
+    // The writer loop runs on the thread that calls run(), so the I/O
+    // executor must be able to run the reader next to that thread.
+    Executor ioExecutor;
+    Executor computeExecutor;
+    barch::EncodeOptions encode;
+    // Called on the reader thread; true skips the job without reading it.
+    std::function<bool(const Job&)> skip;
+    // Called on the reader thread with each input just read, e.g. to hash
+    // it while it is in memory.
+    std::function<void(const Job&, const std::vector<std::uint8_t>&)> onRead;
+    // Called on the writer thread instead of writing Job::outPath, e.g. to
+    // append every output to one archive. May throw.
+    std::function<void(const Job&, const std::vector<std::uint8_t>&)> sink;
+    // Called on the writer thread after each job, including failed and skipped ones.
+    std::function<void(const Job&, const JobDone&)> done;
+};
+
+// Runs a batch as three overlapping stages: one reader, a pool of compute
+// workers and one writer (the calling thread). Stages are connected by bounded
+// queues and draw from two fixed sets of byte buffers (input and output)
+// that are recycled, so memory stays bounded and the disk keeps reading
+// file N+1 and writing file N-1 while file N is being coded.
+class Pipeline
+{
+public:
+    explicit Pipeline(PipelineConfig cfg);
+
+    // Blocks until every job has passed the writer stage.
+    void run(const std::vector<Job>& jobs);
+
+private:
+    PipelineConfig m_cfg;
+};
+
+} // namespace batch
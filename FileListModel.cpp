@@ -1,7 +1,20 @@
 #include "FileListModel.h"
 #include <QtConcurrent>
+#include <QFile>
+#include <QDateTime>
 #include <QFileInfo>
+#include <QImageReader>
+#include <QHash>
+#include <QSettings>
+#include <QSet>
+#include <QUrl>
 #include <QDebug>
+#include <algorithm>
+#include <memory>
+
+#include "OutputStamp.h"
+#include "image_ingest.h"
+
 static QString stripDotLower(const QString& ext)
 {
     QString e = ext;
@@ -10,6 +23,70 @@ static QString stripDotLower(const QString& ext)
     return e.toLower();
 }
 
+struct JobOptions
+{
+    bool incremental = false;
+    bool hashCheck = false;
+    barch::EncodeOptions encode;
+    std::shared_ptr<const RawImageData> reference; // backs encode.reference
+    quint64 encodeKey = 0;
+
+    // Stamped next to outputs so a change of encode settings makes them
+    // stale; decoded images do not depend on them.
+    quint64 stampKey(batch::JobKind kind) const { return kind == batch::JobKind::Encode ? encodeKey : 0; }
+};
+
+// Packs every setting that changes the encoded bytes into 64 bits.
+static quint64 encodeKey(const barch::EncodeOptions& opt, quint32 referenceHash)
+{
+    quint64 key = quint64(referenceHash) << 32;
+    if (opt.lossy)
+        key |= quint64(opt.whiteThreshold) << 24 | quint64(opt.blackThreshold) << 16 | 1;
+    key |= quint64(opt.policy == barch::BlockSizePolicy::Fixed ? opt.blockSize : 0) << 8;
+    key |= quint64(opt.policy) << 1;
+    return key;
+}
+
+static JobOptions makeJobOptions(bool incremental, bool hashCheck, barch::EncodeOptions encode,
+                                 std::shared_ptr<const RawImageData> reference, quint32 referenceHash)
+{
+    encode.reference = reference.get();
+    const quint64 key = encodeKey(encode, reference ? referenceHash : 0);
+    return { incremental, hashCheck, encode, std::move(reference), key };
+}
+
+// A reference image being loaded: read on the I/O pool, decoded and
+// fingerprinted on the CPU pool, then handed to the model.
+struct ReferenceLoad
+{
+    QString path;
+    QByteArray bytes;
+    std::shared_ptr<const RawImageData> img;
+    quint32 hash = 0;
+    QString error;
+};
+
+// Full-size gray image of a BMP, PNG or plain BARCH file.
+static std::shared_ptr<const RawImageData> decodeReferenceImage(const QString& path, const QByteArray& bytes)
+{
+    const auto* p = reinterpret_cast<const std::uint8_t*>(bytes.constData());
+    const std::size_t n = std::size_t(bytes.size());
+
+    auto* img = new RawImageData(stripDotLower(QFileInfo(path).suffix()) == "barch"
+                                     ? barch::decode(p, n) : decodeGrayImage(p, n));
+    return std::shared_ptr<const RawImageData>(img, [](const RawImageData* r) {
+        RawImageData owned = *r;
+        barch::freeImage(owned);
+        delete r;
+    });
+}
+
+static QString referenceKey(const QDir& dir)
+{
+    // QSettings treats '/' and '\\' in keys as group separators
+    return QStringLiteral("reference/") + QString::fromLatin1(QUrl::toPercentEncoding(dir.absolutePath()));
+}
+
 FileListModel::FileListModel(QObject* parent)
     : QAbstractListModel(parent)
 {
@@ -38,6 +115,36 @@ QVariant FileListModel::data(const QModelIndex& index, int role) const
         case StatusTextRole:  return e.status;
         case ErrorRole:       return e.failed;
         case ErrorTextRole:   return e.errText;
+        case DimensionsRole:
+            ensureInfo(e);
+            if (!e.infoValid)
+                return {};
+            return QStringLiteral("%1x%2").arg(e.width).arg(e.height);
+        case RatioRole:
+        {
+            ensureInfo(e);
+            const qint64 raw = qint64(e.width) * e.height;
+            if (!e.infoValid || (e.ext != "barch" && e.ext != "entry") || raw <= 0)
+                return {};
+            return double(e.size) / double(raw);
+        }
+        case DecodeMemoryRole:
+            ensureInfo(e);
+            if (!e.infoValid)
+                return {};
+            return e.decodeMemory;
+        case NsPerPixelRole:  return e.hasStats ? QVariant(e.stats.nsPerPixel()) : QVariant();
+        case ThroughputRole:  return e.hasStats ? QVariant(e.stats.megabytesPerSecond()) : QVariant();
+        case BlockRatioRole:
+            if (!e.hasStats)
+                return {};
+            return QStringLiteral("L %1% W %2% B %3%")
+                .arg(e.stats.literalRatio() * 100, 0, 'f', 1)
+                .arg(e.stats.whiteRatio() * 100, 0, 'f', 1)
+                .arg(e.stats.blackRatio() * 100, 0, 'f', 1);
+        case BytesInRole:     return e.hasStats ? QVariant(qint64(e.stats.bytesIn)) : QVariant();
+        case BytesOutRole:    return e.hasStats ? QVariant(qint64(e.stats.bytesOut)) : QVariant();
+        case IsReferenceRole: return !m_referencePath.isEmpty() && e.path == m_referencePath;
     }
     return {};
 }
@@ -53,7 +160,16 @@ QHash<int, QByteArray> FileListModel::roleNames() const
         { BusyRole, "busy" },
         { StatusTextRole, "statusText" },
         { ErrorRole, "hasError" },
-        { ErrorTextRole, "errorText" }
+        { ErrorTextRole, "errorText" },
+        { DimensionsRole, "dimensions" },
+        { RatioRole, "ratio" },
+        { DecodeMemoryRole, "decodeMemory" },
+        { NsPerPixelRole, "nsPerPixel" },
+        { ThroughputRole, "throughput" },
+        { BlockRatioRole, "blockRatio" },
+        { BytesInRole, "bytesIn" },
+        { BytesOutRole, "bytesOut" },
+        { IsReferenceRole, "isReference" }
     };
 }
 
@@ -70,14 +186,21 @@ void FileListModel::setDirectory(const QString& path)
     endResetModel();
     emit directoryChanged();
     refresh();
+    restoreReference();
 }
 
 void FileListModel::refresh()
 {
+    if (inArchive())
+    {
+        loadArchive(m_archivePath);
+        return;
+    }
+
     beginResetModel();
     m_items.clear();
 
-    QStringList filters = { "*.bmp", "*.png", "*.barch" };
+    QStringList filters = { "*.bmp", "*.png", "*.barch", "*.barx" };
     QFileInfoList list = m_dir.entryInfoList(filters, QDir::Files | QDir::Readable, QDir::Name);
     m_items.reserve(list.size());
     for (const QFileInfo& fi : list)
@@ -105,10 +228,12 @@ void FileListModel::process(int row)
     if (m_items[row].busy)
         return; // already working
 
-    if (ext == "bmp")
+    if (ext == "bmp" || ext == "png")
         startEncode(row);
-     else if (ext == "barch")
+     else if (ext == "barch" || ext == "entry")
         startDecode(row);
+     else if (ext == "barx")
+        openArchive(row);
      else
      {
          qDebug() << "ERROR";
@@ -116,6 +241,497 @@ void FileListModel::process(int row)
      }
 }
 
+// Source stamp of an archive entry made from `path` now.
+static barch::SourceStamp sourceStamp(const QString& path, quint64 options)
+{
+    const QFileInfo fi(path);
+    barch::SourceStamp st;
+    st.size    = quint64(fi.size());
+    st.mtime   = fi.lastModified().toMSecsSinceEpoch();
+    st.options = options;
+    return st;
+}
+
+// Outputs of earlier runs are not inputs of the next one: a decoded
+// "*.unpacked.bmp", a "<src>.packed.barch" next to its listed source, and
+// anything that has a stamp sidecar.
+static bool isGeneratedOutput(const QString& path, const QSet<QString>& listed)
+{
+    static const QString packed = QStringLiteral(".packed.barch");
+    if (path.endsWith(QStringLiteral(".unpacked.bmp"), Qt::CaseInsensitive))
+        return true;
+    if (path.endsWith(packed, Qt::CaseInsensitive) && listed.contains(path.chopped(packed.size())))
+        return true;
+    return QFileInfo::exists(stamp::sidecarPath(path));
+}
+
+std::vector<batch::Job> FileListModel::queueBatchJobs(const QString& archiveOut)
+{
+    const bool toArchive = !archiveOut.isEmpty();
+    QSet<QString> listed;
+    for (const Entry& e : m_items)
+        listed.insert(e.path);
+
+    // Smallest files first, as the scheduler does for single jobs, so the
+    // list starts filling in at once; equal sizes keep name order.
+    QList<int> rows;
+    for (int row = 0; row < m_items.size(); ++row)
+    {
+        const Entry& e = m_items[row];
+        const bool encode = (e.ext == "bmp" || e.ext == "png");
+        if (!e.busy && (encode || (e.ext == "barch" && !toArchive)) && !isGeneratedOutput(e.path, listed))
+            rows.append(row);
+    }
+    std::stable_sort(rows.begin(), rows.end(), [this](int a, int b) {
+        return m_items[a].size < m_items[b].size;
+    });
+
+    std::vector<batch::Job> jobs;
+    for (int row : rows)
+    {
+        const Entry& e = m_items[row];
+        const bool encode = (e.ext == "bmp" || e.ext == "png");
+        batch::Job job;
+        job.id      = jobs.size();
+        job.kind    = encode ? batch::JobKind::Encode : batch::JobKind::Decode;
+        job.inPath  = e.path.toStdString();
+        job.outPath = toArchive ? archiveOut.toStdString()
+                                : (e.path + (encode ? ".packed.barch" : ".unpacked.bmp")).toStdString();
+        jobs.push_back(job);
+
+        setFailure(row, false, {});
+        setBusy(row, true, QStringLiteral("Queued"));
+    }
+    return jobs;
+}
+
+void FileListModel::processAll()
+{
+    if (m_batchWatcher || inArchive())
+        return;
+
+    std::vector<batch::Job> jobs = queueBatchJobs({});
+    if (jobs.empty())
+        return;
+
+    batch::PipelineConfig cfg;
+    const JobOptions opt = makeJobOptions(m_incremental, m_hashCheck, m_encodeOptions, m_reference, m_referenceHash);
+    if (opt.incremental)
+    {
+        cfg.skip = [opt](const batch::Job& job) {
+            return stamp::isCurrent(QString::fromStdString(job.inPath), QString::fromStdString(job.outPath),
+                                    opt.hashCheck, opt.stampKey(job.kind));
+        };
+    }
+    // Sources are hashed by the reader while in memory; the queues order
+    // each slot's write before the writer's read of it.
+    auto hashes = std::make_shared<std::vector<quint64>>(jobs.size(), 0);
+    if (opt.hashCheck)
+    {
+        cfg.onRead = [hashes](const batch::Job& job, const std::vector<std::uint8_t>& bytes) {
+            (*hashes)[job.id] = stamp::contentHash(bytes.data(), bytes.size());
+        };
+    }
+    runBatch(std::move(jobs), std::move(cfg), [opt, hashes](const batch::Job& job) {
+        stamp::write(QString::fromStdString(job.inPath), QString::fromStdString(job.outPath),
+                     (*hashes)[job.id], opt.stampKey(job.kind));
+    }, {});
+}
+
+void FileListModel::archiveAll()
+{
+    if (m_batchWatcher || inArchive())
+        return;
+
+    const QString archive = m_dir.absoluteFilePath(
+        (m_dir.dirName().isEmpty() ? QStringLiteral("images") : m_dir.dirName()) + QStringLiteral(".barx"));
+    std::vector<batch::Job> jobs = queueBatchJobs(archive);
+    if (jobs.empty())
+        return;
+
+    auto writer = std::make_shared<barch::ArchiveWriter>();
+    try {
+        writer->open(archive.toStdString());
+    } catch (const std::exception& e) {
+        JobResult res;
+        res.error = QString::fromUtf8(e.what());
+        for (const batch::Job& job : jobs)
+            finishBatchJob(QString::fromStdString(job.inPath), archive, res);
+        setError(tr("Cannot open archive \"%1\": %2").arg(archive, res.error));
+        return;
+    }
+
+    // Entry names are the source file names; the single writer thread
+    // serialises the appends.
+    auto names = std::make_shared<std::vector<std::string>>();
+    for (const batch::Job& job : jobs)
+        names->push_back(QFileInfo(QString::fromStdString(job.inPath)).fileName().toStdString());
+
+    // Each entry records the source's size and mtime and the encode
+    // settings, like an output stamp, so edits and setting changes make it
+    // stale. Entries that are stale or missing are replaced or appended.
+    const quint64 key = makeJobOptions(m_incremental, m_hashCheck, m_encodeOptions, m_reference, m_referenceHash)
+                            .stampKey(batch::JobKind::Encode);
+    batch::PipelineConfig cfg;
+    if (m_incremental)
+    {
+        auto archived = std::make_shared<QHash<QString, barch::SourceStamp>>();
+        try {
+            for (const barch::ArchiveEntry& e : barch::listArchive(archive.toStdString()))
+                archived->insert(QString::fromStdString(e.name), e.source);
+        } catch (const std::exception&) {
+            // no archive yet
+        }
+        cfg.skip = [archived, names, key](const batch::Job& job) {
+            const auto it = archived->constFind(QString::fromStdString(names->at(job.id)));
+            if (it == archived->constEnd())
+                return false;
+            const barch::SourceStamp now = sourceStamp(QString::fromStdString(job.inPath), key);
+            return it->size == now.size && it->mtime == now.mtime && it->options == now.options;
+        };
+    }
+    cfg.sink = [writer, names, key](const batch::Job& job, const std::vector<std::uint8_t>& bytes) {
+        writer->appendEncoded(names->at(job.id), bytes.data(), bytes.size(),
+                              sourceStamp(QString::fromStdString(job.inPath), key));
+    };
+    runBatch(std::move(jobs), std::move(cfg), {}, [this, writer, archive]() {
+        try {
+            writer->close();
+        } catch (const std::exception& e) {
+            const QString msg = QString::fromUtf8(e.what());
+            QMetaObject::invokeMethod(this, [this, archive, msg]() {
+                setError(tr("Cannot write archive \"%1\": %2").arg(archive, msg));
+            }, Qt::QueuedConnection);
+        }
+    });
+}
+
+void FileListModel::runBatch(std::vector<batch::Job> jobs, batch::PipelineConfig cfg,
+                             std::function<void(const batch::Job&)> onWritten,
+                             std::function<void()> afterRun)
+{
+    cfg.computeThreads = m_scheduler.cpuThreads();
+    cfg.encode = m_encodeOptions;
+    cfg.encode.reference = m_reference.get();
+    cfg.done = [this, onWritten](const batch::Job& job, const batch::JobDone& done) {
+        const QString in  = QString::fromStdString(job.inPath);
+        const QString out = QString::fromStdString(job.outPath);
+        JobResult res;
+        res.skipped = done.skipped;
+        res.error   = QString::fromStdString(done.error);
+        res.stats   = done.stats;
+        if (onWritten && !res.skipped && res.error.isEmpty())
+            onWritten(job);
+        QMetaObject::invokeMethod(this, [this, in, out, res]() {
+            finishBatchJob(in, out, res);
+        }, Qt::QueuedConnection);
+    };
+
+    m_batchWatcher = new QFutureWatcher<void>(this);
+    connect(m_batchWatcher, &QFutureWatcher<void>::finished, this, [this]() {
+        m_batchWatcher->deleteLater();
+        m_batchWatcher = nullptr;
+        emit batchRunningChanged();
+    });
+    // Every stage runs on the scheduler's pools so the batch stays within
+    // the configured limits: the driver is the writer and, like the reader,
+    // takes an I/O thread; the workers take CPU threads. Size 0 puts them
+    // ahead of any per-file jobs already queued.
+    JobScheduler* sched = &m_scheduler;
+    cfg.ioExecutor = [sched](std::function<void()> fn) { sched->io(0, std::move(fn)); };
+    cfg.computeExecutor = [sched](std::function<void()> fn) { sched->cpu(0, std::move(fn)); };
+    // `ref` keeps cfg.encode.reference alive until the pipeline is done
+    m_batchWatcher->setFuture(m_scheduler.io(0, [cfg, jobs = std::move(jobs), afterRun, ref = m_reference]() {
+        batch::Pipeline(cfg).run(jobs);
+        if (afterRun)
+            afterRun();
+    }));
+    emit batchRunningChanged();
+}
+
+void FileListModel::finishBatchJob(const QString& inPath, const QString& outPath, const JobResult& res)
+{
+    const int row = rowForPath(inPath);
+    if (row < 0)
+        return; // directory was refreshed meanwhile
+
+    if (res.skipped)
+    {
+        setBusy(row, false, QStringLiteral("Up to date"));
+        insertIfExists(outPath);
+    } else if (res.error.isEmpty())
+    {
+        setBusy(row, false, QStringLiteral("Ready"));
+        recordStats(row, res.stats);
+        insertIfExists(outPath);
+    } else
+    {
+        setBusy(row, false, QStringLiteral("Error"));
+        setFailure(row, true, res.error);
+    }
+}
+
+QVariantMap FileListModel::stats() const
+{
+    const stats::JobStats& t = m_rolling.total();
+    return {
+        { "nsPerPixel", t.nsPerPixel() },
+        { "mbPerSecond", t.megabytesPerSecond() },
+        { "literalRatio", t.literalRatio() },
+        { "whiteRatio", t.whiteRatio() },
+        { "blackRatio", t.blackRatio() },
+        { "bytesIn", qint64(t.bytesIn) },
+        { "bytesOut", qint64(t.bytesOut) },
+        { "jobs", qint64(m_rolling.jobs()) }
+    };
+}
+
+void FileListModel::recordStats(int row, const stats::JobStats& st)
+{
+    m_rolling.add(st);
+    emit statsChanged();
+
+    if (row < 0 || row >= m_items.size())
+        return;
+    Entry& e = m_items[row];
+    e.hasStats = true;
+    e.stats = st;
+    const QModelIndex idx = index(row);
+    emit dataChanged(idx, idx, { NsPerPixelRole, ThroughputRole, BlockRatioRole, BytesInRole, BytesOutRole });
+}
+
+int FileListModel::rowForPath(const QString& absPath) const
+{
+    for (int i = 0; i < m_items.size(); ++i)
+        if (m_items[i].path == absPath)
+            return i;
+    return -1;
+}
+
+void FileListModel::setThreadLimits(int cpuThreads, int ioThreads)
+{
+    if (cpuThreads == m_scheduler.cpuThreads() && ioThreads == m_scheduler.ioThreads())
+        return;
+    m_scheduler.setLimits(cpuThreads, ioThreads);
+    emit threadLimitsChanged();
+}
+
+void FileListModel::openArchive(int row)
+{
+    if (row < 0 || row >= m_items.size() || m_items[row].ext != "barx" || m_batchWatcher)
+        return;
+    loadArchive(m_items[row].path);
+}
+
+void FileListModel::closeArchive()
+{
+    if (!inArchive() || m_batchWatcher)
+        return;
+    m_archivePath.clear();
+    m_archiveEntries.clear();
+    emit archiveChanged();
+    refresh();
+}
+
+void FileListModel::loadArchive(const QString& path)
+{
+    std::vector<barch::ArchiveEntry> entries;
+    try {
+        entries = barch::listArchive(path.toStdString());
+    } catch (const std::exception& e) {
+        setError(tr("Cannot open archive \"%1\": %2").arg(path, QString::fromUtf8(e.what())));
+        return;
+    }
+
+    beginResetModel();
+    m_items.clear();
+    m_items.reserve(int(entries.size()));
+    for (std::size_t i = 0; i < entries.size(); ++i)
+    {
+        const barch::ArchiveEntry& a = entries[i];
+        Entry e;
+        e.name = QString::fromStdString(a.name);
+        // unique per entry even when names repeat
+        e.path = QStringLiteral("%1#%2").arg(path).arg(i);
+        e.size = qint64(a.size);
+        e.ext  = QStringLiteral("entry");
+        e.archiveIndex = int(i);
+        // the archive index already carries the metadata
+        e.infoLoaded = true;
+        e.infoValid  = true;
+        e.width  = a.width;
+        e.height = a.height;
+        e.decodeMemory = e.size + qint64(a.width) * a.height;
+        m_items.push_back(e);
+    }
+    const bool changed = (m_archivePath != path);
+    m_archivePath = path;
+    m_archiveEntries = std::move(entries);
+    endResetModel();
+    if (changed)
+        emit archiveChanged();
+}
+
+int FileListModel::blockSize() const
+{
+    return m_encodeOptions.policy == barch::BlockSizePolicy::Fixed ? m_encodeOptions.blockSize : 0;
+}
+
+void FileListModel::setBlockSize(int size)
+{
+    if (size != 0 && size != 4 && size != 8 && size != 16)
+        return;
+    if (size == blockSize())
+        return;
+    if (size == 0)
+        m_encodeOptions.policy = barch::BlockSizePolicy::Smallest;
+    else
+    {
+        m_encodeOptions.policy = barch::BlockSizePolicy::Fixed;
+        m_encodeOptions.blockSize = size;
+    }
+    emit encodeOptionsChanged();
+}
+
+void FileListModel::setLossy(bool on)
+{
+    if (m_encodeOptions.lossy == on)
+        return;
+    m_encodeOptions.lossy = on;
+    emit encodeOptionsChanged();
+}
+
+void FileListModel::setWhiteThreshold(int value)
+{
+    if (value < 0 || value > 255 || value <= m_encodeOptions.blackThreshold
+        || value == m_encodeOptions.whiteThreshold)
+        return;
+    m_encodeOptions.whiteThreshold = static_cast<std::uint8_t>(value);
+    emit encodeOptionsChanged();
+}
+
+void FileListModel::setBlackThreshold(int value)
+{
+    if (value < 0 || value > 255 || value >= m_encodeOptions.whiteThreshold
+        || value == m_encodeOptions.blackThreshold)
+        return;
+    m_encodeOptions.blackThreshold = static_cast<std::uint8_t>(value);
+    emit encodeOptionsChanged();
+}
+
+void FileListModel::setReference(int row)
+{
+    if (row < 0 || row >= m_items.size() || inArchive())
+        return;
+    const Entry& e = m_items[row];
+    if (e.ext != "bmp" && e.ext != "png" && e.ext != "barch")
+        return;
+    if (e.path != m_referencePath)
+        loadReference(e.path, true);
+}
+
+void FileListModel::clearReference()
+{
+    ++m_referenceGeneration; // drop a load still in flight
+    if (m_referencePath.isEmpty())
+        return;
+    QSettings settings;
+    settings.remove(referenceKey(m_dir));
+    applyReference({}, nullptr, 0);
+}
+
+void FileListModel::restoreReference()
+{
+    ++m_referenceGeneration; // loads in flight belong to the previous directory
+    QSettings settings;
+    const QString name = settings.value(referenceKey(m_dir)).toString();
+    const QString path = name.isEmpty() ? QString() : m_dir.absoluteFilePath(name);
+    if (path == m_referencePath)
+        return;
+    // Jobs started before the new one is loaded encode without a reference.
+    applyReference({}, nullptr, 0);
+    if (!path.isEmpty() && QFileInfo::exists(path))
+        loadReference(path, false);
+}
+
+void FileListModel::loadReference(const QString& path, bool remember)
+{
+    const quint64 generation = ++m_referenceGeneration;
+    const qint64 size = QFileInfo(path).size();
+    auto ld = std::make_shared<ReferenceLoad>();
+    ld->path = path;
+
+    auto* watcher = new QFutureWatcher<void>(this);
+    connect(watcher, &QFutureWatcher<void>::finished, this, [this, watcher, ld, generation, remember]() {
+        watcher->deleteLater();
+        if (generation != m_referenceGeneration)
+            return; // another reference was chosen meanwhile
+        if (!ld->error.isEmpty())
+        {
+            setError(tr("Cannot use \"%1\" as reference: %2").arg(ld->path, ld->error));
+            return;
+        }
+        applyReference(ld->path, std::move(ld->img), ld->hash);
+        if (remember)
+        {
+            QSettings settings;
+            settings.setValue(referenceKey(m_dir), QFileInfo(ld->path).fileName());
+        }
+    });
+
+    JobScheduler* sched = &m_scheduler;
+    watcher->setFuture(sched->io(size, [ld]() {
+        QFile f(ld->path);
+        if (!f.open(QIODevice::ReadOnly))
+            ld->error = QStringLiteral("reference: cannot open");
+        else
+            ld->bytes = f.readAll();
+    }).then(QtFuture::Launch::Sync, [sched, ld, size]() {
+        return sched->cpu(size, [ld]() {
+            if (!ld->error.isEmpty())
+                return;
+            try {
+                ld->img  = decodeReferenceImage(ld->path, ld->bytes);
+                ld->hash = barch::referenceFingerprint(*ld->img);
+            } catch (const std::exception& e) {
+                ld->error = QString::fromUtf8(e.what());
+            }
+            ld->bytes = QByteArray();
+        });
+    }).unwrap());
+}
+
+void FileListModel::applyReference(const QString& path, std::shared_ptr<const RawImageData> img, quint32 hash)
+{
+    const QString old = m_referencePath;
+    m_referencePath = path;
+    m_referenceHash = hash;
+    m_reference = std::move(img);
+    for (const QString& p : { old, path })
+    {
+        const int row = rowForPath(p);
+        if (row >= 0)
+            emit dataChanged(index(row), index(row), { IsReferenceRole });
+    }
+    emit referenceChanged();
+}
+
+void FileListModel::setIncremental(bool on)
+{
+    if (m_incremental == on)
+        return;
+    m_incremental = on;
+    emit incrementalChanged();
+}
+
+void FileListModel::setHashCheck(bool on)
+{
+    if (m_hashCheck == on)
+        return;
+    m_hashCheck = on;
+    emit hashCheckChanged();
+}
+
 void FileListModel::clearError()
 {
     if (m_error.isEmpty())
@@ -133,6 +749,45 @@ QString FileListModel::prettySize(qint64 bytes)
     return QString::number(v, 'f', (u==0?0:1)) + " " + units[u];
 }
 
+void FileListModel::ensureInfo(const Entry& e)
+{
+    if (e.infoLoaded)
+        return;
+    e.infoLoaded = true;
+    try {
+        if (e.ext == "barch")
+        {
+            const BarchInfo info = barch::peekInfo(e.path.toStdString());
+            e.width  = info.width;
+            e.height = info.height;
+            // Whole file is read into memory, plus the 8-bit output image.
+            e.decodeMemory = e.size + qint64(info.width) * info.height;
+            e.infoValid = true;
+        } else if (e.ext == "bmp")
+        {
+            const BMPInfo info = peekBMPInfo(e.path.toStdString());
+            e.width  = info.width;
+            e.height = info.height;
+            e.decodeMemory = qint64(info.width) * info.height;
+            e.infoValid = true;
+        } else if (e.ext == "png")
+        {
+            // QImageReader only parses the IHDR chunk for size()
+            const QSize sz = QImageReader(e.path).size();
+            if (sz.isValid())
+            {
+                e.width  = sz.width();
+                e.height = sz.height();
+                // decoded PNG at 32 bpp plus the gray copy
+                e.decodeMemory = qint64(sz.width()) * sz.height() * 5;
+                e.infoValid = true;
+            }
+        }
+    } catch (const std::exception& ex) {
+        qDebug() << "ensureInfo:" << e.path << ex.what();
+    }
+}
+
 void FileListModel::setError(const QString& text)
 {
     m_error = text;
@@ -160,58 +815,123 @@ void FileListModel::setFailure(int row, bool failed, const QString& msg)
     emit dataChanged(idx, idx, { ErrorRole, ErrorTextRole, StatusTextRole });
 }
 
-static void doEncode(const QString& inPath, const QString& outPath)
+// One file job split into I/O and CPU stages; each stage is a no-op once
+// an earlier one has skipped or failed the job.
+struct JobState
 {
-    qDebug() << "Start encode";
-    RawImageData img = loadGrayBMP(inPath.toStdString());
-    barch::saveToFile(outPath.toStdString(), img);
-    barch::freeImage(img);
-    qDebug() << "End encode";
-}
-
-static void doDecode(const QString& inPath, const QString& outPath)
+    batch::JobKind kind = batch::JobKind::Encode;
+    QString inPath;
+    QString outPath;
+    QString archivePath; // set when inPath names an archive entry
+    barch::ArchiveEntry archiveEntry;
+    JobOptions opt;
+    std::vector<std::uint8_t> input;
+    std::vector<std::uint8_t> output;
+    quint64 inputHash = 0; // for the stamp, taken while the input is in memory
+    FileListModel::JobResult result;
+
+    bool finished() const { return result.skipped || !result.error.isEmpty(); }
+};
+
+static void readStage(JobState& st)
 {
-    RawImageData img = barch::loadFromFile(inPath.toStdString());
-    writeGrayBMP(outPath.toStdString(), img);
-    barch::freeImage(img);
+    try {
+        if (st.opt.incremental && stamp::isCurrent(st.inPath, st.outPath, st.opt.hashCheck, st.opt.stampKey(st.kind)))
+        {
+            st.result.skipped = true;
+            return;
+        }
+        if (!st.archivePath.isEmpty())
+        {
+            const std::string archive = st.archivePath.toStdString();
+            stats::ScopedTimer t(st.result.stats.readNs, "read", archive);
+            barch::readArchiveEntry(archive, st.archiveEntry, st.input);
+            st.result.stats.bytesIn += st.input.size();
+        } else
+        {
+            batch::readFile(st.inPath.toStdString(), st.input, st.result.stats);
+            if (st.opt.hashCheck)
+                st.inputHash = stamp::contentHash(st.input.data(), st.input.size());
+        }
+    } catch (const std::exception& e) {
+        st.result.error = QString::fromUtf8(e.what());
+    }
 }
 
-
-static QString encodeJob(const QString& inPath, const QString& outPath)
+static void computeStage(JobState& st)
 {
+    if (st.finished())
+        return;
     try {
-        RawImageData img = loadGrayBMP(inPath.toStdString());
-        barch::saveToFile(outPath.toStdString(), img);
-        barch::freeImage(img);
-        return {};
+        batch::transcode(st.kind, st.input, st.output, st.result.stats, st.inPath.toStdString(), st.opt.encode);
     } catch (const std::exception& e) {
-        return QString::fromUtf8(e.what());
+        st.result.error = QString::fromUtf8(e.what());
     }
+    std::vector<std::uint8_t>().swap(st.input);
 }
 
-static QString decodeJob(const QString& inPath, const QString& outPath)
+static void writeStage(JobState& st)
 {
+    if (st.finished())
+        return;
     try {
-        RawImageData img = barch::loadFromFile(inPath.toStdString());
-        writeGrayBMP(outPath.toStdString(), img);
-        barch::freeImage(img);
-        return {};
+        batch::writeFile(st.outPath.toStdString(), st.output, st.result.stats);
+        // an archive entry's "x.barx#N" path is not a file a stamp can describe
+        if (st.archivePath.isEmpty())
+            stamp::write(st.inPath, st.outPath, st.inputHash, st.opt.stampKey(st.kind));
     } catch (const std::exception& e) {
-        return QString::fromUtf8(e.what());
+        st.result.error = QString::fromUtf8(e.what());
     }
 }
 
+QFuture<FileListModel::JobResult> FileListModel::scheduleJob(batch::JobKind kind, const QString& inPath,
+                                                             const QString& outPath, qint64 size)
+{
+    auto st = std::make_shared<JobState>();
+    st->kind    = kind;
+    st->inPath  = inPath;
+    st->outPath = outPath;
+    st->opt     = makeJobOptions(m_incremental, m_hashCheck, m_encodeOptions, m_reference, m_referenceHash);
+    const int row = rowForPath(inPath);
+    if (inArchive() && row >= 0 && m_items[row].archiveIndex >= 0)
+    {
+        st->archivePath  = m_archivePath;
+        st->archiveEntry = m_archiveEntries[std::size_t(m_items[row].archiveIndex)];
+        st->opt.incremental = false; // stamps track files, not entries
+    }
+
+    JobScheduler* sched = &m_scheduler;
+    return sched->io(size, [st]() { readStage(*st); })
+        .then(QtFuture::Launch::Sync, [sched, st, size]() {
+            return sched->cpu(size, [st]() { computeStage(*st); });
+        }).unwrap()
+        .then(QtFuture::Launch::Sync, [sched, st, size]() {
+            return sched->io(size, [st]() { writeStage(*st); });
+        }).unwrap()
+        .then(QtFuture::Launch::Sync, [st]() { return st->result; });
+}
+
 void FileListModel::insertIfExists(const QString& absPath)
 {
+    if (inArchive())
+        return; // outputs land in the directory, not in the archive view
     QFileInfo fi(absPath);
     if (!fi.exists()) return;
     const QString ext = stripDotLower(fi.suffix());
-    if (ext != "bmp" && ext != "png" && ext != "barch") return;
+    if (ext != "bmp" && ext != "png" && ext != "barch" && ext != "barx") return;
 
-    // avoid duplicates
-    for (const auto& it : m_items)
-        if (it.path == fi.absoluteFilePath())
-            return;
+    // avoid duplicates, but drop stale metadata of an overwritten output
+    for (int i = 0; i < m_items.size(); ++i)
+    {
+        Entry& it = m_items[i];
+        if (it.path != fi.absoluteFilePath())
+            continue;
+        it.size = fi.size();
+        it.infoLoaded = false;
+        const QModelIndex idx = index(i);
+        emit dataChanged(idx, idx, { SizeRole, PrettySizeRole, DimensionsRole, RatioRole, DecodeMemoryRole });
+        return;
+    }
 
     Entry e;
     e.name = fi.fileName();
@@ -230,68 +950,42 @@ void FileListModel::insertIfExists(const QString& absPath)
 
 void FileListModel::startEncode(int row)
 {
-    Entry& e = m_items[row];
-    QString out = e.path + ".packed.barch";
-
-    setFailure(row, false, {});
-    setBusy(row, true, QStringLiteral("Coding"));
-    auto* watcher = new QFutureWatcher<QString>(this);
-    e.watcher = watcher;
-
-    QFuture<QString> fut = QtConcurrent::run([in=e.path, out]() { return encodeJob(in, out); });
-
-    setFailure(row, false, {});
-    connect(watcher, &QFutureWatcher<QString>::finished, this, [this, row, out]() {
-        Entry& en = m_items[row];
-        QString err = en.watcher->future().result();
-        en.watcher->deleteLater();
-        en.watcher = nullptr;
-
-        if (err.isEmpty())
-        {
-            setBusy(row, false, QStringLiteral("Ready"));
-            insertIfExists(out);
-        } else
-        {
-            setBusy(row, false, QStringLiteral("Error"));
-            setFailure(row, true, err);
-            setError(tr("Error during encode \"%1\": %2").arg(en.name, err));
-        }
-    });
-
-    watcher->setFuture(fut);
+    const Entry& e = m_items[row];
+    watchJob(row, batch::JobKind::Encode, e.path + ".packed.barch", QStringLiteral("Coding"));
 }
 
 void FileListModel::startDecode(int row)
 {
-    Entry& e = m_items[row];
+    const Entry& e = m_items[row];
     QString out = e.path + ".unpacked.bmp";
+    if (e.archiveIndex >= 0)
+    {
+        // extract next to the archive, named after the entry
+        const QString base = QFileInfo(e.name).fileName();
+        out = QFileInfo(m_archivePath).absoluteDir().absoluteFilePath(
+            (base.isEmpty() ? QStringLiteral("entry%1").arg(e.archiveIndex) : base) + ".unpacked.bmp");
+    }
+    watchJob(row, batch::JobKind::Decode, out, QStringLiteral("Decoding"));
+}
 
-    setFailure(row, false, {});
-    setBusy(row, true, QStringLiteral("Decoding"));
-    auto* watcher = new QFutureWatcher<QString>(this);
-    e.watcher = watcher;
-
-    QFuture<QString> fut = QtConcurrent::run([in=e.path, out]() { return decodeJob(in, out); });
+void FileListModel::watchJob(int row, batch::JobKind kind, const QString& out, const QString& status)
+{
+    const QString in   = m_items[row].path;
+    const QString name = m_items[row].name;
 
     setFailure(row, false, {});
-    connect(watcher, &QFutureWatcher<QString>::finished, this, [this, row, out]() {
-        Entry& en = m_items[row];
-        QString err = en.watcher->future().result();
-        en.watcher->deleteLater();
-        en.watcher = nullptr;
-
-        if (err.isEmpty())
-        {
-            setBusy(row, false, QStringLiteral("Ready"));
-            insertIfExists(out);
-        } else
-        {
-            setBusy(row, false, QStringLiteral("Error"));
-            setFailure(row, true, err);
-        }
+    setBusy(row, true, status);
+
+    // The list may be refreshed or switch between directory and archive
+    // before the job ends, so the row is looked up again by path.
+    auto* watcher = new QFutureWatcher<JobResult>(this);
+    connect(watcher, &QFutureWatcher<JobResult>::finished, this, [this, watcher, kind, in, out, name]() {
+        const JobResult res = watcher->future().result();
+        watcher->deleteLater();
+
+        finishBatchJob(in, out, res);
+        if (!res.skipped && !res.error.isEmpty() && kind == batch::JobKind::Encode)
+            setError(tr("Error during encode \"%1\": %2").arg(name, res.error));
     });
-
-    watcher->setFuture(fut);
+    watcher->setFuture(scheduleJob(kind, in, out, m_items[row].size));
 }
-
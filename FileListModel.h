@@ -4,9 +4,16 @@
 #include <QVector>
 #include <QDir>
 #include <QString>
+#include <QVariantMap>
 
 #include "barch.hpp"
 #include "bmp_io.h"
+#include "BatchPipeline.h"
+#include "JobScheduler.h"
+#include "JobStats.h"
+#include "barch_archive.h"
+#include <functional>
+#include <memory>
 
 class FileListModel : public QAbstractListModel
 {
@@ -14,6 +21,19 @@ class FileListModel : public QAbstractListModel
     Q_PROPERTY(QString directory READ directory WRITE setDirectory NOTIFY directoryChanged)
     Q_PROPERTY(bool hasError READ hasError NOTIFY errorChanged)
     Q_PROPERTY(QString errorText READ errorText NOTIFY errorChanged)
+    Q_PROPERTY(bool incremental READ incremental WRITE setIncremental NOTIFY incrementalChanged)
+    Q_PROPERTY(bool hashCheck READ hashCheck WRITE setHashCheck NOTIFY hashCheckChanged)
+    Q_PROPERTY(bool batchRunning READ batchRunning NOTIFY batchRunningChanged)
+    Q_PROPERTY(int cpuThreads READ cpuThreads WRITE setCpuThreads NOTIFY threadLimitsChanged)
+    Q_PROPERTY(int ioThreads READ ioThreads WRITE setIoThreads NOTIFY threadLimitsChanged)
+    Q_PROPERTY(QVariantMap stats READ stats NOTIFY statsChanged)
+    Q_PROPERTY(QString archivePath READ archivePath NOTIFY archiveChanged)
+    Q_PROPERTY(int blockSize READ blockSize WRITE setBlockSize NOTIFY encodeOptionsChanged)
+    Q_PROPERTY(bool lossy READ lossy WRITE setLossy NOTIFY encodeOptionsChanged)
+    Q_PROPERTY(int whiteThreshold READ whiteThreshold WRITE setWhiteThreshold NOTIFY encodeOptionsChanged)
+    Q_PROPERTY(int blackThreshold READ blackThreshold WRITE setBlackThreshold NOTIFY encodeOptionsChanged)
+    Q_PROPERTY(bool inArchive READ inArchive NOTIFY archiveChanged)
+    Q_PROPERTY(QString referencePath READ referencePath NOTIFY referenceChanged)
 
 public:
     enum Roles
@@ -26,7 +46,16 @@ public:
         BusyRole,
         StatusTextRole,
         ErrorRole,
-        ErrorTextRole
+        ErrorTextRole,
+        DimensionsRole,
+        RatioRole,
+        DecodeMemoryRole,
+        NsPerPixelRole,
+        ThroughputRole,
+        BlockRatioRole,
+        BytesInRole,
+        BytesOutRole,
+        IsReferenceRole
     };
     Q_ENUM(Roles)
 
@@ -41,14 +70,82 @@ public:
 
     Q_INVOKABLE void refresh();
     Q_INVOKABLE void process(int row);
+    // Encodes every BMP/PNG and decodes every BARCH through the batch pipeline.
+    Q_INVOKABLE void processAll();
+    // Encodes every BMP/PNG into one "<dir name>.barx" archive.
+    Q_INVOKABLE void archiveAll();
+    // Lists the entries of a .barx row instead of the directory;
+    // process() on an entry extracts it next to the archive.
+    Q_INVOKABLE void openArchive(int row);
+    Q_INVOKABLE void closeArchive();
     Q_INVOKABLE void clearError();
+    // Encodes of this directory store the difference against the image in
+    // `row`, and decodes use it to restore delta files. Remembered per
+    // directory in QSettings.
+    Q_INVOKABLE void setReference(int row);
+    Q_INVOKABLE void clearReference();
 
     bool hasError() const { return !m_error.isEmpty(); }
     QString errorText() const { return m_error; }
 
+    // Skip jobs whose output is newer than (or stamped from) the source.
+    bool incremental() const { return m_incremental; }
+    void setIncremental(bool on);
+    // Also record and compare a content hash of the source.
+    bool hashCheck() const { return m_hashCheck; }
+    void setHashCheck(bool on);
+
+    bool batchRunning() const { return m_batchWatcher != nullptr; }
+
+    // Per-pool concurrency; <= 0 restores the default. Persisted in QSettings.
+    int cpuThreads() const { return m_scheduler.cpuThreads(); }
+    int ioThreads() const { return m_scheduler.ioThreads(); }
+    void setCpuThreads(int n) { setThreadLimits(n, ioThreads()); }
+    void setIoThreads(int n) { setThreadLimits(cpuThreads(), n); }
+    void setThreadLimits(int cpuThreads, int ioThreads);
+
+    // Rolling totals over the last jobs: nsPerPixel, mbPerSecond,
+    // literalRatio, whiteRatio, blackRatio, bytesIn, bytesOut, jobs.
+    QVariantMap stats() const;
+
+    // Pixels per block for new encodes: 4, 8 or 16; 0 picks the smallest
+    // output per image by sampling it.
+    int blockSize() const;
+    void setBlockSize(int size);
+
+    // Snap near-white/near-black blocks to white/black before encoding (see
+    // barch::EncodeOptions::lossy). Thresholds are 0..255; a value that
+    // would leave black >= white is ignored.
+    bool lossy() const { return m_encodeOptions.lossy; }
+    void setLossy(bool on);
+    int whiteThreshold() const { return m_encodeOptions.whiteThreshold; }
+    void setWhiteThreshold(int value);
+    int blackThreshold() const { return m_encodeOptions.blackThreshold; }
+    void setBlackThreshold(int value);
+
+    QString archivePath() const { return m_archivePath; }
+    bool inArchive() const { return !m_archivePath.isEmpty(); }
+
+    QString referencePath() const { return m_referencePath; }
+
+    struct JobResult
+    {
+        QString error;
+        bool skipped = false;
+        stats::JobStats stats;
+    };
+
 signals:
     void directoryChanged();
     void errorChanged();
+    void incrementalChanged();
+    void hashCheckChanged();
+    void batchRunningChanged();
+    void threadLimitsChanged();
+    void statsChanged();
+    void archiveChanged();
+    void encodeOptionsChanged();
+    void referenceChanged();
 
 private:
     struct Entry
@@ -61,19 +158,61 @@ private:
         QString status;
         bool    failed = false;
         QString errText;
-        QFutureWatcher<QString>* watcher = nullptr;
+
+        // Header metadata, filled on first request by ensureInfo().
+        mutable bool   infoLoaded = false;
+        mutable bool   infoValid = false;
+        mutable int    width = 0;
+        mutable int    height = 0;
+        mutable qint64 decodeMemory = 0;
+
+        int archiveIndex = -1; // into m_archiveEntries when browsing an archive
+
+        bool hasStats = false;
+        stats::JobStats stats;
     };
     QVector<Entry> m_items;
     QDir m_dir;
     QString m_error;
+    bool m_incremental = true;
+    bool m_hashCheck = false;
+    QFutureWatcher<void>* m_batchWatcher = nullptr;
+    JobScheduler m_scheduler;
+    stats::RollingStats m_rolling;
+    barch::EncodeOptions m_encodeOptions;
+    QString m_archivePath;
+    std::vector<barch::ArchiveEntry> m_archiveEntries;
+    QString m_referencePath;
+    // Shared with running jobs, which keep it alive past clearReference().
+    std::shared_ptr<const RawImageData> m_reference;
+    quint32 m_referenceHash = 0;
+    // Bumped by every reference change; a load finishing under an older
+    // value is stale and dropped.
+    quint64 m_referenceGeneration = 0;
 
     static QString prettySize(qint64 bytes);
+    static void ensureInfo(const Entry& e);
     void setError(const QString& text);
 
+    QFuture<JobResult> scheduleJob(batch::JobKind kind, const QString& inPath, const QString& outPath, qint64 size);
     void startEncode(int row);
     void startDecode(int row);
+    void watchJob(int row, batch::JobKind kind, const QString& out, const QString& status);
 
     void insertIfExists(const QString& absPath);
+    int rowForPath(const QString& absPath) const;
+    void recordStats(int row, const stats::JobStats& st);
+    void loadArchive(const QString& path);
+    // Reads and decodes on the scheduler pools, then applies on this
+    // thread; `remember` stores the choice for the directory.
+    void loadReference(const QString& path, bool remember);
+    void applyReference(const QString& path, std::shared_ptr<const RawImageData> img, quint32 hash);
+    void restoreReference();
+    std::vector<batch::Job> queueBatchJobs(const QString& archiveOut);
+    void runBatch(std::vector<batch::Job> jobs, batch::PipelineConfig cfg,
+                  std::function<void(const batch::Job&)> onWritten,
+                  std::function<void()> afterRun);
+    void finishBatchJob(const QString& inPath, const QString& outPath, const JobResult& res);
 
     void setBusy(int row, bool busy, const QString& statusText);
     void setFailure(int row, bool failed, const QString& msg = QString());
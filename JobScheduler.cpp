@@ -0,0 +1,72 @@
+#include "JobScheduler.h"
+#include <QSettings>
+#include <QtAlgorithms>
+
+namespace {
+
+constexpr int kDefaultIoThreads = 4;
+// A batch holds two I/O threads for its whole run (reader and writer).
+constexpr int kMinIoThreads = 2;
+const char kCpuKey[] = "scheduler/cpuThreads";
+const char kIoKey[]  = "scheduler/ioThreads";
+
+} // namespace
+
+JobScheduler::JobScheduler()
+{
+    QSettings settings;
+    const int cpu = settings.value(kCpuKey).toInt();
+    const int io  = settings.value(kIoKey).toInt();
+    m_cpu.setMaxThreadCount(cpu > 0 ? cpu : defaultCpuThreads());
+    m_io.setMaxThreadCount(io > 0 ? qMax(io, kMinIoThreads) : defaultIoThreads());
+}
+
+JobScheduler::~JobScheduler()
+{
+    // A job finishing on one pool may queue its next stage on the other, so
+    // drain both until a pass finds them idle; only then may either go.
+    do {
+        m_cpu.waitForDone();
+        m_io.waitForDone();
+    } while (!m_cpu.waitForDone(0) || !m_io.waitForDone(0));
+}
+
+void JobScheduler::setLimits(int cpuThreads, int ioThreads)
+{
+    if (cpuThreads <= 0)
+        cpuThreads = defaultCpuThreads();
+    if (ioThreads <= 0)
+        ioThreads = defaultIoThreads();
+    ioThreads = qMax(ioThreads, kMinIoThreads);
+    m_cpu.setMaxThreadCount(cpuThreads);
+    m_io.setMaxThreadCount(ioThreads);
+
+    QSettings settings;
+    settings.setValue(kCpuKey, cpuThreads);
+    settings.setValue(kIoKey, ioThreads);
+}
+
+int JobScheduler::defaultCpuThreads()
+{
+    return QThread::idealThreadCount();
+}
+
+int JobScheduler::defaultIoThreads()
+{
+    return kDefaultIoThreads;
+}
+
+int JobScheduler::priorityFor(qint64 jobBytes)
+{
+    // One priority level per power of two: small files jump ahead, jobs of
+    // similar size keep their FIFO order.
+    return int(qCountLeadingZeroBits(quint64(qMax<qint64>(jobBytes, 1))));
+}
+
+QFuture<void> JobScheduler::spawn(QThreadPool& pool, qint64 jobBytes, std::function<void()> fn)
+{
+    return QtConcurrent::task(std::move(fn))
+        .onThreadPool(pool)
+        .withPriority(priorityFor(jobBytes))
+        .spawn();
+}
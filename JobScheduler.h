@@ -0,0 +1,36 @@
+#pragma once
+#include <QThreadPool>
+#include <QFuture>
+#include <QtConcurrent>
+#include <functional>
+
+// Two private thread pools so disk/network-bound stages cannot starve the
+// CPU-bound ones, and neither competes with Qt's global pool. Within a pool
+// smaller jobs run first, so quick files give feedback early.
+class JobScheduler
+{
+public:
+    JobScheduler();
+    // Waits for every queued and running job, including stages that jobs
+    // still hand over from one pool to the other.
+    ~JobScheduler();
+
+    int cpuThreads() const { return m_cpu.maxThreadCount(); }
+    int ioThreads() const { return m_io.maxThreadCount(); }
+    // Values <= 0 restore the default; the I/O pool keeps at least two
+    // threads. Persisted in QSettings.
+    void setLimits(int cpuThreads, int ioThreads);
+
+    QFuture<void> cpu(qint64 jobBytes, std::function<void()> fn) { return spawn(m_cpu, jobBytes, std::move(fn)); }
+    QFuture<void> io(qint64 jobBytes, std::function<void()> fn) { return spawn(m_io, jobBytes, std::move(fn)); }
+
+    static int defaultCpuThreads();
+    static int defaultIoThreads();
+
+private:
+    static int priorityFor(qint64 jobBytes);
+    static QFuture<void> spawn(QThreadPool& pool, qint64 jobBytes, std::function<void()> fn);
+
+    QThreadPool m_cpu;
+    QThreadPool m_io;
+};
@@ -0,0 +1,136 @@
+#include "JobStats.h"
+#include <functional>
+#include <thread>
+
+namespace stats
+{
+
+namespace {
+
+constexpr double kNsPerSecond = 1e9;
+constexpr double kBytesPerMB = 1024.0 * 1024.0;
+
+inline double ratio(std::uint64_t part, std::uint64_t whole)
+{
+    return whole ? double(part) / double(whole) : 0.0;
+}
+
+inline std::uint64_t codedBlocks(const BlockStats& b)
+{
+    return b.whiteBlocks + b.blackBlocks + b.literalBlocks;
+}
+
+std::string jsonEscape(const std::string& s)
+{
+    std::string out;
+    out.reserve(s.size());
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out.push_back('\\');
+        if (static_cast<unsigned char>(c) >= 0x20)
+            out.push_back(c);
+    }
+    return out;
+}
+
+} // namespace
+
+double JobStats::nsPerPixel() const
+{
+    return pixels ? double(bmpNs + codecNs) / double(pixels) : 0.0;
+}
+
+double JobStats::megabytesPerSecond() const
+{
+    const std::int64_t ns = totalNs();
+    return ns > 0 ? (double(bytesIn) / kBytesPerMB) / (double(ns) / kNsPerSecond) : 0.0;
+}
+
+double JobStats::literalRatio() const { return ratio(blocks.literalBlocks, codedBlocks(blocks)); }
+double JobStats::whiteRatio() const   { return ratio(blocks.whiteBlocks, codedBlocks(blocks)); }
+double JobStats::blackRatio() const   { return ratio(blocks.blackBlocks, codedBlocks(blocks)); }
+
+JobStats& JobStats::operator+=(const JobStats& o)
+{
+    readNs   += o.readNs;
+    bmpNs    += o.bmpNs;
+    codecNs  += o.codecNs;
+    writeNs  += o.writeNs;
+    bytesIn  += o.bytesIn;
+    bytesOut += o.bytesOut;
+    pixels   += o.pixels;
+    blocks.whiteBlocks   += o.blocks.whiteBlocks;
+    blocks.blackBlocks   += o.blocks.blackBlocks;
+    blocks.literalBlocks += o.blocks.literalBlocks;
+    blocks.emptyRows     += o.blocks.emptyRows;
+    return *this;
+}
+
+void RollingStats::add(const JobStats& s)
+{
+    m_jobs.push_back(s);
+    if (m_jobs.size() > m_window)
+    {
+        // recompute instead of subtracting so unsigned fields cannot drift
+        m_jobs.pop_front();
+        m_total = JobStats();
+        for (const JobStats& j : m_jobs)
+            m_total += j;
+        return;
+    }
+    m_total += s;
+}
+
+TraceLog& TraceLog::instance()
+{
+    static TraceLog log;
+    return log;
+}
+
+TraceLog::~TraceLog()
+{
+    close();
+}
+
+bool TraceLog::open(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_out.open(path, std::ios::trunc);
+    if (!m_out)
+        return false;
+    m_out << "[\n";
+    m_origin = std::chrono::steady_clock::now();
+    m_first = true;
+    m_enabled = true;
+    return true;
+}
+
+void TraceLog::close()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_enabled)
+        return;
+    m_enabled = false;
+    m_out << "\n]\n";
+    m_out.close();
+}
+
+void TraceLog::complete(const char* name, const std::string& file,
+                        std::chrono::steady_clock::time_point start, std::int64_t durNs)
+{
+    const std::size_t tid = std::hash<std::thread::id>()(std::this_thread::get_id()) % 100000;
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_enabled)
+        return;
+    const auto tsUs = std::chrono::duration_cast<std::chrono::microseconds>(start - m_origin).count();
+    if (!m_first)
+        m_out << ",\n";
+    m_first = false;
+    m_out << "{\"name\":\"" << name << "\",\"cat\":\"barch\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+          << ",\"ts\":" << tsUs << ",\"dur\":" << double(durNs) / 1000.0
+          << ",\"args\":{\"file\":\"" << jsonEscape(file) << "\"}}";
+}
+
+} // namespace stats
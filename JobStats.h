@@ -0,0 +1,111 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+#include "barch.hpp"
+
+namespace stats
+{
+
+// Timings and volumes of one job. "bmp" is loading the source image (BMP
+// or PNG) or writing the BMP output,
+// "codec" is BARCH encode or decode; both run in memory.
+struct JobStats
+{
+    std::int64_t readNs = 0;
+    std::int64_t bmpNs = 0;
+    std::int64_t codecNs = 0;
+    std::int64_t writeNs = 0;
+    std::uint64_t bytesIn = 0;
+    std::uint64_t bytesOut = 0;
+    std::uint64_t pixels = 0;
+    BlockStats blocks;
+
+    std::int64_t totalNs() const { return readNs + bmpNs + codecNs + writeNs; }
+    // Compute time only, so slow disks do not mask codec regressions.
+    double nsPerPixel() const;
+    // Input bytes over wall time of all stages.
+    double megabytesPerSecond() const;
+    // Share of literal/white/black among coded blocks, 0 when none.
+    double literalRatio() const;
+    double whiteRatio() const;
+    double blackRatio() const;
+
+    JobStats& operator+=(const JobStats& o);
+};
+
+// Sum over the last `window` jobs. Not synchronised: feed it from one thread.
+class RollingStats
+{
+public:
+    explicit RollingStats(std::size_t window = 64) : m_window(window) {}
+
+    void add(const JobStats& s);
+    const JobStats& total() const { return m_total; }
+    std::size_t jobs() const { return m_jobs.size(); }
+
+private:
+    std::size_t m_window;
+    std::deque<JobStats> m_jobs;
+    JobStats m_total;
+};
+
+// Chrome trace-event JSON ("X" complete events), viewable in about:tracing
+// or Perfetto. Disabled unless open() succeeded; thread-safe.
+class TraceLog
+{
+public:
+    static TraceLog& instance();
+
+    bool open(const std::string& path);
+    void close();
+    bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+    void complete(const char* name, const std::string& file,
+                  std::chrono::steady_clock::time_point start, std::int64_t durNs);
+
+private:
+    TraceLog() = default;
+    ~TraceLog();
+
+    std::mutex m_lock;
+    std::ofstream m_out;
+    std::chrono::steady_clock::time_point m_origin;
+    std::atomic_bool m_enabled { false };
+    bool m_first = true;
+};
+
+// Adds the scope's duration to `acc` and, when tracing, emits an event.
+// `file` is copied (only while tracing), so temporaries are fine.
+class ScopedTimer
+{
+public:
+    ScopedTimer(std::int64_t& acc, const char* name, const std::string& file)
+        : m_acc(acc), m_name(name), m_file(TraceLog::instance().enabled() ? file : std::string()),
+          m_start(std::chrono::steady_clock::now())
+    {
+    }
+    ~ScopedTimer()
+    {
+        const std::int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                    std::chrono::steady_clock::now() - m_start).count();
+        m_acc += ns;
+        TraceLog& log = TraceLog::instance();
+        if (log.enabled())
+            log.complete(m_name, m_file, m_start, ns);
+    }
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    std::int64_t& m_acc;
+    const char* m_name;
+    std::string m_file;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+} // namespace stats
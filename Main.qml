@@ -16,9 +16,69 @@ ApplicationWindow {
     header: ToolBar {
         RowLayout {
             anchors.fill: parent
+            ToolButton {
+                text: "\u2190"
+                visible: fileModel.inArchive
+                onClicked: fileModel.closeArchive()
+            }
             Label {
-                text: "Current Dir: " + startDir
+                text: fileModel.inArchive ? "Archive: " + fileModel.archivePath
+                                          : "Current Dir: " + startDir
                 Layout.fillWidth: true
+                elide: Text.ElideMiddle
+            }
+            Label {
+                visible: fileModel.stats.jobs > 0
+                text: fileModel.stats.nsPerPixel.toFixed(2) + " ns/px  "
+                      + fileModel.stats.mbPerSecond.toFixed(1) + " MB/s  lit "
+                      + (fileModel.stats.literalRatio * 100).toFixed(0) + "%"
+            }
+            ToolButton {
+                visible: fileModel.referencePath !== "" && !fileModel.inArchive
+                text: "Ref: " + fileModel.referencePath.split("/").pop() + " \u2715"
+                onClicked: fileModel.clearReference()
+                ToolTip.visible: hovered
+                ToolTip.text: "Encodes store the difference to this image; click to clear"
+            }
+            ComboBox {
+                id: blockBox
+                model: ["Auto", "4", "8", "16"]
+                implicitWidth: 90
+                currentIndex: Math.max(0, model.indexOf(fileModel.blockSize === 0 ? "Auto" : String(fileModel.blockSize)))
+                onActivated: fileModel.blockSize = currentIndex === 0 ? 0 : parseInt(currentText)
+                ToolTip.visible: hovered
+                ToolTip.text: "Pixels per block"
+            }
+            CheckBox {
+                text: "Denoise"
+                checked: fileModel.lossy
+                onToggled: fileModel.lossy = checked
+                ToolTip.visible: hovered
+                ToolTip.text: "Lossy: blocks with every pixel >= " + fileModel.whiteThreshold
+                              + " encode as white, <= " + fileModel.blackThreshold + " as black"
+            }
+            CheckBox {
+                text: "Skip up-to-date"
+                checked: fileModel.incremental
+                onToggled: fileModel.incremental = checked
+            }
+            CheckBox {
+                text: "Hash"
+                enabled: fileModel.incremental
+                checked: fileModel.hashCheck
+                onToggled: fileModel.hashCheck = checked
+            }
+            Button {
+                text: "Process all"
+                visible: !fileModel.inArchive
+                enabled: !fileModel.batchRunning
+                onClicked: fileModel.processAll()
+            }
+            Button {
+                text: "Archive all"
+                visible: !fileModel.inArchive
+                enabled: !fileModel.batchRunning
+                onClicked: fileModel.archiveAll()
             }
             Button {
                 text: "Refresh"
@@ -50,15 +110,41 @@ ApplicationWindow {
                 leftPadding: 16
                 rightPadding: 16
 
-                Label { text: name; width: 420; elide: Text.ElideRight; color: hasError ? "#ffcccc" : "white" }
+                Image {
+                    width: 40; height: 40
+                    anchors.verticalCenter: parent.verticalCenter
+                    visible: ext === "barch"
+                    source: ext === "barch" ? "image://barch/" + encodeURIComponent(path) : ""
+                    sourceSize: Qt.size(40, 40)
+                    fillMode: Image.PreserveAspectFit
+                    asynchronous: true
+                    // the provider keeps its own cache keyed by path and mtime
+                    cache: false
+                }
+                Label { text: (isReference ? "\u2605 " : "") + name; width: ext === "barch" ? 368 : 420; elide: Text.ElideRight; color: hasError ? "#ffcccc" : "white" }
                 Label { text: prettySize; width: 100; horizontalAlignment: Text.AlignRight; color: hasError ? "#ffcccc" : "#cccccc" }
-                Label { text: statusText; width: 160; color: hasError ? "#ff8a8a" : (busy ? "#55c1ff" : "#a0a0a0") }
+                Label { text: statusText + (throughput !== undefined ? "  " + throughput.toFixed(1) + " MB/s" : ""); width: 160; color: hasError ? "#ff8a8a" : (busy ? "#55c1ff" : "#a0a0a0") }
                 BusyIndicator { running: busy; visible: busy; width: 24; height: 24 }
             }
 
             MouseArea {
+                id: rowMouse
                 anchors.fill: parent
-                onClicked: {
+                hoverEnabled: true
+                acceptedButtons: Qt.LeftButton | Qt.RightButton
+                // Roles below are peeked from file headers on first access only.
+                ToolTip.visible: containsMouse && ToolTip.text !== ""
+                ToolTip.delay: 400
+                ToolTip.text: containsMouse && dimensions !== undefined
+                              ? dimensions
+                                + (ratio !== undefined ? "  ratio " + ratio.toFixed(3) : "")
+                                + "  mem " + (decodeMemory / 1048576).toFixed(1) + " MB"
+                              : ""
+                onClicked: (mouse) => {
+                    if (mouse.button === Qt.RightButton) {
+                        fileModel.setReference(index)
+                        return
+                    }
                     console.log(index)
                     fileModel.process(index)
                 }
@@ -0,0 +1,146 @@
+#include "OutputStamp.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QSaveFile>
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+constexpr char kStampTag[] = "barch-stamp-2"; // "-1" lacked the options field
+constexpr qint64 kHashChunk = 1 << 20;
+constexpr quint64 kHashSeed = 0x9E3779B97F4A7C15ull;
+constexpr quint64 kHashMul  = 0xFF51AFD7ED558CCDull;
+
+struct Stamp
+{
+    qint64  srcSize = -1;
+    qint64  srcMtime = -1;
+    qint64  outSize = -1;
+    quint64 hash = 0; // 0 = not recorded
+    quint64 options = 0;
+};
+
+inline quint64 mix(quint64 h, quint64 w)
+{
+    h ^= w;
+    h *= kHashMul;
+    return h ^ (h >> 32);
+}
+
+// Folds one chunk of up to kHashChunk bytes into h.
+quint64 hashChunk(quint64 h, const char* p, qsizetype n)
+{
+    qsizetype i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        quint64 w;
+        std::memcpy(&w, p + i, 8);
+        h = mix(h, w);
+    }
+    quint64 tail = 0;
+    std::memcpy(&tail, p + i, size_t(n - i));
+    return mix(h, tail ^ quint64(n - i) << 56);
+}
+
+bool readStamp(const QString& path, Stamp& st)
+{
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+    const QList<QByteArray> parts = f.readLine().trimmed().split(' ');
+    if (parts.size() != 6 || parts[0] != kStampTag)
+        return false;
+    bool ok[5];
+    st.srcSize  = parts[1].toLongLong(&ok[0]);
+    st.srcMtime = parts[2].toLongLong(&ok[1]);
+    st.outSize  = parts[3].toLongLong(&ok[2]);
+    st.hash     = parts[4].toULongLong(&ok[3], 16);
+    st.options  = parts[5].toULongLong(&ok[4], 16);
+    return ok[0] && ok[1] && ok[2] && ok[3] && ok[4];
+}
+
+} // namespace
+
+namespace stamp
+{
+
+QString sidecarPath(const QString& outPath)
+{
+    return outPath + QStringLiteral(".stamp");
+}
+
+quint64 contentHash(const QString& path)
+{
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly))
+        return 0;
+
+    quint64 h = kHashSeed ^ quint64(f.size());
+    QByteArray chunk;
+    while (!(chunk = f.read(kHashChunk)).isEmpty())
+        h = hashChunk(h, chunk.constData(), chunk.size());
+    return h ? h : 1;
+}
+
+quint64 contentHash(const std::uint8_t* data, std::size_t size)
+{
+    quint64 h = kHashSeed ^ quint64(size);
+    for (std::size_t off = 0; off < size; off += kHashChunk)
+        h = hashChunk(h, reinterpret_cast<const char*>(data) + off,
+                      qsizetype(std::min<std::size_t>(kHashChunk, size - off)));
+    return h ? h : 1;
+}
+
+bool isCurrent(const QString& srcPath, const QString& outPath, bool checkHash, quint64 options)
+{
+    const QFileInfo src(srcPath);
+    const QFileInfo out(outPath);
+    if (!src.exists() || !out.exists() || out.size() == 0)
+        return false;
+
+    const QString sidecar = sidecarPath(outPath);
+    Stamp st;
+    if (!readStamp(sidecar, st))
+        return !QFileInfo::exists(sidecar) && out.lastModified() >= src.lastModified();
+
+    if (st.options != options || st.outSize != out.size() || st.srcSize != src.size())
+        return false;
+    if (st.srcMtime == src.lastModified().toMSecsSinceEpoch())
+        return true;
+    if (!checkHash || st.hash == 0)
+        return false;
+    const quint64 hash = contentHash(srcPath);
+    if (hash != st.hash)
+        return false;
+
+    // Same bytes under a new mtime (copied or touched): refresh the stamp.
+    write(srcPath, outPath, hash, options);
+    return true;
+}
+
+void write(const QString& srcPath, const QString& outPath, quint64 srcHash, quint64 options)
+{
+    const QFileInfo src(srcPath);
+    const QFileInfo out(outPath);
+
+    QSaveFile f(sidecarPath(outPath));
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+        qDebug() << "stamp: cannot write" << f.fileName();
+        return;
+    }
+    const QByteArray line = QByteArray(kStampTag) + ' '
+                            + QByteArray::number(src.size()) + ' '
+                            + QByteArray::number(src.lastModified().toMSecsSinceEpoch()) + ' '
+                            + QByteArray::number(out.size()) + ' '
+                            + QByteArray::number(srcHash, 16) + ' '
+                            + QByteArray::number(options, 16) + '\n';
+    f.write(line);
+    if (!f.commit())
+        qDebug() << "stamp: commit failed" << f.fileName();
+}
+
+} // namespace stamp
@@ -0,0 +1,26 @@
+#pragma once
+#include <QString>
+#include <QtGlobal>
+#include <cstddef>
+#include <cstdint>
+
+// Sidecar "<output>.stamp" recording which source produced an output, so
+// batch re-runs can skip jobs whose output is still current.
+namespace stamp
+{
+// Output exists and was produced from the source as it is now, with the
+// same `options` (an opaque key of the settings that shape the output).
+// Without a stamp, falls back to "output is newer than source". With
+// checkHash, a source whose mtime changed but whose content did not still
+// counts.
+bool isCurrent(const QString& srcPath, const QString& outPath, bool checkHash, quint64 options);
+// `srcHash` is contentHash() of the source, or 0 to record none. Callers
+// that still hold the source bytes hash those instead of reading it again.
+void write(const QString& srcPath, const QString& outPath, quint64 srcHash, quint64 options);
+// Fast non-cryptographic 64-bit hash of the file content; 0 if unreadable.
+quint64 contentHash(const QString& path);
+// The same hash of bytes already in memory; equal to contentHash() of a
+// file holding them.
+quint64 contentHash(const std::uint8_t* data, std::size_t size);
+QString sidecarPath(const QString& outPath);
+} // namespace stamp
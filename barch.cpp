@@ -1,25 +1,58 @@
 #include "barch.hpp"
+#include "gray_rows.h"
+#include "crc32c.h"
 
 #include <stdexcept>
 #include <fstream>
 #include <cstring>
 #include <climits>
 #include <algorithm>
-#include <iterator>
+#include <memory>
 #include <QDebug>
+#include <QFile>
 
 namespace {
 
 constexpr char kMagic0 = 'B';
 constexpr char kMagic1 = 'A';
-constexpr std::uint8_t kFileVersion = 0x01;
+constexpr std::uint8_t kFileVersionV1 = 0x01; // fixed 4-pixel blocks
+constexpr std::uint8_t kFileVersionV2 = 0x02; // block size stored in the header
+constexpr std::uint8_t kFileVersionV3 = 0x03; // flags and reference fingerprint
+constexpr std::uint8_t kFileVersion   = 0x04; // per-band CRC32C
 static_assert(CHAR_BIT == 8, "BARCH requires 8-bit bytes");
 constexpr int kBitsPerByte = CHAR_BIT;
-constexpr int kPixelsPerBlock = 4;
+constexpr int kV1PixelsPerBlock = 4;
 constexpr unsigned char kWhite = 0xFF;
 constexpr unsigned char kBlack = 0x00;
 constexpr unsigned char kPadPixelForCoding = kWhite;
 
+constexpr std::size_t kOffMagic0       = 0;
+constexpr std::size_t kOffMagic1       = 1;
+constexpr std::size_t kOffVersion      = 2;
+constexpr std::size_t kOffWidth        = 3;
+constexpr std::size_t kOffHeight       = 7;
+constexpr std::size_t kOffRowIndexSize = 11;
+constexpr std::size_t kOffDataSize     = 15;
+constexpr std::size_t kHeaderSizeV1    = 19;
+constexpr std::size_t kOffBlockSize    = 19;
+constexpr std::size_t kHeaderSizeV2    = 20;
+constexpr std::size_t kOffFlags        = 20;
+constexpr std::size_t kOffRefHash      = 21;
+constexpr std::size_t kHeaderSizeV3    = 25;
+constexpr std::size_t kOffBandRows     = 25;
+constexpr std::size_t kOffHeaderCrc    = 29;
+constexpr std::size_t kHeaderSize      = 33;
+
+// Version 4 splits the bitstream into byte-aligned bands of kBandRows rows.
+// The band table follows the row index, one entry per band:
+//   u32 end offset of the band in the bitstream, u32 CRC32C of its bytes
+// The header CRC covers the header up to itself, the row index and the
+// band table.
+constexpr std::uint32_t kBandRows = 256;
+constexpr std::size_t kBandEntrySize = 8;
+
+constexpr std::uint8_t kFlagDelta = 0x01; // pixels are stored as img ^ ref ^ kWhite
+
 struct TagBits
 {
     static constexpr std::uint32_t WhiteVal = 0b0;  static constexpr int WhiteLen = 1;
@@ -35,6 +68,11 @@ inline void writeLE32(std::vector<std::uint8_t>& buf, std::uint32_t v)
     for (int i = 0; i < 4; ++i)
         buf.push_back(static_cast<std::uint8_t>(v >> (i * CHAR_BIT)));
 }
+inline void patchLE32(std::uint8_t* p, std::uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        p[i] = static_cast<std::uint8_t>(v >> (i * CHAR_BIT));
+}
 inline std::uint32_t readLE32(const std::uint8_t* p)
 {
     std::uint32_t v = 0;
@@ -43,21 +81,24 @@ inline std::uint32_t readLE32(const std::uint8_t* p)
     return v;
 }
 
-inline bool isRowEmpty(const unsigned char* row, int width)
+// `white` is the lowest value that counts as white (below kWhite when lossy).
+inline bool isRowEmpty(const unsigned char* row, int width, unsigned char white = kWhite)
 {
     for (int i = 0; i < width; ++i)
-        if (row[i] != kWhite)
+        if (row[i] < white)
             return false;
     return true;
 }
 
 constexpr int kMSBIndex = kBitsPerByte - 1;
 
+// Appends to a caller-owned buffer so encodeTo() can reuse its capacity.
 struct BitWriter
 {
-    std::vector<std::uint8_t> out;
+    std::vector<std::uint8_t>& out;
     std::uint8_t cur = 0;
     int bitpos = 0;
+    explicit BitWriter(std::vector<std::uint8_t>& out_) : out(out_) {}
 
     void putBit(int b)
     {
@@ -79,14 +120,17 @@ struct BitWriter
         for (int i = kMSBIndex; i >= 0; --i)
             putBit((b >> i) & 1);
     }
-    std::vector<std::uint8_t> finish()
+    void finish()
     {
         if (bitpos)
             out.push_back(cur);
-        return out;
+        cur = 0;
+        bitpos = 0;
     }
 };
 
+// Checked reads throw at the end of the buffer. Unchecked reads are only
+// valid once the caller has made sure enough bits are left (see bitsLeft()).
 struct BitReader
 {
     const std::uint8_t* p;
@@ -95,9 +139,12 @@ struct BitReader
     int bitpos = 0;
     BitReader(const std::uint8_t* p_, std::size_t n_) : p(p_), n(n_) {}
 
+    std::size_t bitsLeft() const { return (n - idx) * kBitsPerByte - bitpos; }
+
+    template <bool Checked = true>
     int getBit()
     {
-        if (idx >= n)
+        if (Checked && idx >= n)
         {
             qDebug() << "Unexpected end of bitstream";
             throw std::runtime_error("Unexpected end of bitstream");
@@ -118,179 +165,761 @@ struct BitReader
             v = (v << 1) | getBit();
         return v;
     }
-    std::uint8_t getByte() { return static_cast<std::uint8_t>(getBits(kBitsPerByte)); }
+    template <bool Checked = true>
+    std::uint8_t getByte()
+    {
+        if (Checked)
+            return static_cast<std::uint8_t>(getBits(kBitsPerByte));
+        // a whole byte straddles at most two input bytes
+        std::uint8_t v = static_cast<std::uint8_t>(p[idx] << bitpos);
+        if (bitpos)
+            v |= static_cast<std::uint8_t>(p[idx + 1] >> (kBitsPerByte - bitpos));
+        ++idx;
+        return v;
+    }
 };
 
-} // namespace
+struct Header
+{
+    std::uint32_t width;
+    std::uint32_t height;
+    std::uint32_t rowIndexSize;
+    std::uint32_t dataSize;
+    int blockSize;
+    std::size_t headerSize; // offset of the row index
+    std::uint8_t flags = 0;
+    std::uint32_t refHash = 0;
+    std::uint32_t bandRows = 0;   // rows per band; the whole image before version 4
+    std::uint32_t bands = 1;
+    bool hasBandTable = false;
+    std::size_t bandTableOffset = 0;
+    std::size_t dataOffset = 0;  // offset of the bitstream
+};
 
-namespace barch
+inline bool isSupportedBlockSize(int bs)
 {
+    return bs == 4 || bs == 8 || bs == 16;
+}
 
-std::vector<std::uint8_t> encode(const RawImageData& img)
+// Validates the fixed-size header only; callers check the payload length.
+Header readHeader(const std::uint8_t* bytes, std::size_t size)
 {
-    if (!img.data || img.width <= 0 || img.height <= 0)
+    if (!bytes || size < kHeaderSizeV1)
     {
-        qDebug() << "encode: invalid input image";
-        throw std::invalid_argument("encode: invalid input image");
+        qDebug() << "decode: too small";
+        throw std::runtime_error("decode: too small");
+    }
+    if (bytes[kOffMagic0] != kMagic0 || bytes[kOffMagic1] != kMagic1)
+    {
+        qDebug() << "decode: bad magic";
+        throw std::runtime_error("decode: bad magic");
     }
 
-    const int W = img.width;
-    const int H = img.height;
-    const int rowIndexBytes = ceilDiv(H, kBitsPerByte);
+    Header hdr;
+    const std::uint8_t version = bytes[kOffVersion];
+    if (version == kFileVersionV1)
+    {
+        hdr.blockSize  = kV1PixelsPerBlock;
+        hdr.headerSize = kHeaderSizeV1;
+    } else if (version >= kFileVersionV2 && version <= kFileVersion)
+    {
+        hdr.headerSize = (version == kFileVersionV2) ? kHeaderSizeV2
+                       : (version == kFileVersionV3) ? kHeaderSizeV3 : kHeaderSize;
+        if (size < hdr.headerSize)
+        {
+            qDebug() << "decode: too small";
+            throw std::runtime_error("decode: too small");
+        }
+        hdr.blockSize = bytes[kOffBlockSize];
+        if (version >= kFileVersionV3)
+        {
+            hdr.flags   = bytes[kOffFlags];
+            hdr.refHash = readLE32(bytes + kOffRefHash);
+        }
+        if (version >= kFileVersion)
+        {
+            hdr.bandRows     = readLE32(bytes + kOffBandRows);
+            hdr.hasBandTable = true;
+        }
+        if (!isSupportedBlockSize(hdr.blockSize))
+        {
+            qDebug() << "decode: unsupported block size";
+            throw std::runtime_error("decode: unsupported block size");
+        }
+    } else
+    {
+        qDebug() << "decode: unsupported version";
+        throw std::runtime_error("decode: unsupported version");
+    }
 
-    std::vector<std::uint8_t> rowIndex(rowIndexBytes, 0);
-    std::vector<bool> nonEmpty(H, false);
-    for (int y = 0; y < H; ++y)
+    hdr.width        = readLE32(bytes + kOffWidth);
+    hdr.height       = readLE32(bytes + kOffHeight);
+    hdr.rowIndexSize = readLE32(bytes + kOffRowIndexSize);
+    hdr.dataSize     = readLE32(bytes + kOffDataSize);
+    if (hdr.rowIndexSize < ceilDiv<std::uint32_t>(hdr.height, kBitsPerByte))
     {
-        const unsigned char* row = img.data + y * W;
-        const bool empty = isRowEmpty(row, W);
-        if (empty)
-            rowIndex[y / kBitsPerByte] |= (1u << (y % kBitsPerByte));
-        else nonEmpty[y] = true;
+        qDebug() << "decode: row index too small";
+        throw std::runtime_error("decode: row index too small");
+    }
+    if (hdr.flags & ~kFlagDelta)
+    {
+        qDebug() << "decode: unsupported flags";
+        throw std::runtime_error("decode: unsupported flags");
     }
 
-    BitWriter bw;
-    for (int y = 0; y < H; ++y)
+    if (hdr.hasBandTable)
+    {
+        if (hdr.bandRows == 0)
+        {
+            qDebug() << "decode: invalid band size";
+            throw std::runtime_error("decode: invalid band size");
+        }
+        hdr.bands = ceilDiv<std::uint32_t>(hdr.height, hdr.bandRows);
+    } else
+    {
+        hdr.bandRows = std::max<std::uint32_t>(hdr.height, 1);
+    }
+    hdr.bandTableOffset = hdr.headerSize + std::size_t(hdr.rowIndexSize);
+    hdr.dataOffset = hdr.bandTableOffset + (hdr.hasBandTable ? std::size_t(hdr.bands) * kBandEntrySize : 0);
+    return hdr;
+}
+
+// Checks that the file holds the whole payload and, for version 4, the
+// header CRC and a band table that tiles the bitstream. Needs no pixels.
+void checkLayout(const Header& hdr, const std::uint8_t* bytes, std::size_t size)
+{
+    if (size < hdr.dataOffset + std::size_t(hdr.dataSize))
+    {
+        qDebug() << "decode: truncated file";
+        throw std::runtime_error("decode: truncated file");
+    }
+    if (!hdr.hasBandTable)
+        return;
+
+    std::uint32_t crc = crc::crc32c(bytes, kOffHeaderCrc);
+    crc = crc::crc32c(bytes + hdr.headerSize, hdr.dataOffset - hdr.headerSize, crc);
+    if (crc != readLE32(bytes + kOffHeaderCrc))
+    {
+        qDebug() << "decode: header checksum mismatch";
+        throw std::runtime_error("decode: header checksum mismatch");
+    }
+
+    std::uint32_t prev = 0;
+    for (std::uint32_t b = 0; b < hdr.bands; ++b)
+    {
+        const std::uint32_t end = readLE32(bytes + hdr.bandTableOffset + b * kBandEntrySize);
+        if (end < prev || end > hdr.dataSize)
+        {
+            qDebug() << "decode: invalid band table";
+            throw std::runtime_error("decode: invalid band table");
+        }
+        prev = end;
+    }
+    if (prev != hdr.dataSize)
+    {
+        qDebug() << "decode: invalid band table";
+        throw std::runtime_error("decode: invalid band table");
+    }
+}
+
+struct Band
+{
+    std::uint32_t y0;
+    std::uint32_t y1;
+    const std::uint8_t* data;
+    std::size_t size;
+};
+
+// Band `b` of a file that passed checkLayout(); verifies its CRC if asked.
+Band bandAt(const Header& hdr, const std::uint8_t* bytes, std::uint32_t b, bool checkCrc)
+{
+    Band band;
+    band.y0 = b * hdr.bandRows;
+    band.y1 = std::min(hdr.height, band.y0 + hdr.bandRows);
+    if (!hdr.hasBandTable)
+    {
+        band.data = bytes + hdr.dataOffset;
+        band.size = hdr.dataSize;
+        return band;
+    }
+
+    const std::uint8_t* entry = bytes + hdr.bandTableOffset + b * kBandEntrySize;
+    const std::uint32_t begin = b ? readLE32(entry - kBandEntrySize) : 0;
+    const std::uint32_t end = readLE32(entry);
+    band.data = bytes + hdr.dataOffset + begin;
+    band.size = end - begin;
+    if (checkCrc && crc::crc32c(band.data, band.size) != readLE32(entry + 4))
+    {
+        qDebug() << "decode: band checksum mismatch";
+        throw std::runtime_error("decode: band checksum mismatch");
+    }
+    return band;
+}
+
+// FNV-1a over the dimensions and pixels, eight bytes at a time, folded to 32
+// bits. Only guards against decoding with the wrong reference.
+std::uint32_t fingerprint(const RawImageData& img)
+{
+    constexpr std::uint64_t kPrime = 0x100000001b3ull;
+    std::uint64_t h = 0xcbf29ce484222325ull;
+    h = (h ^ std::uint64_t(std::uint32_t(img.width))) * kPrime;
+    h = (h ^ std::uint64_t(std::uint32_t(img.height))) * kPrime;
+
+    const std::size_t total = std::size_t(img.width) * std::size_t(img.height);
+    std::size_t i = 0;
+    for (; i + 8 <= total; i += 8)
+    {
+        std::uint64_t w;
+        std::memcpy(&w, img.data + i, 8);
+        h = (h ^ w) * kPrime;
+    }
+    for (; i < total; ++i)
+        h = (h ^ img.data[i]) * kPrime;
+    return static_cast<std::uint32_t>(h ^ (h >> 32));
+}
+
+inline bool sameSize(const RawImageData& a, const RawImageData& b)
+{
+    return a.width == b.width && a.height == b.height;
+}
+
+// dst = a ^ b ^ kWhite: equal pixels become white. The transform is its own
+// inverse, so the decoder applies it again with the same reference.
+void xorWithReference(unsigned char* dst, const unsigned char* a, const unsigned char* b, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; ++i)
+        dst[i] = static_cast<unsigned char>(a[i] ^ b[i] ^ kWhite);
+}
+
+inline int countEmptyRows(const std::uint8_t* rowIndex, std::uint32_t height)
+{
+    int n = 0;
+    for (std::uint32_t y = 0; y < height; ++y)
+        n += (rowIndex[y / kBitsPerByte] >> (y % kBitsPerByte)) & 1;
+    return n;
+}
+
+// Tag cost in bits of one block, used to estimate encoded size. Values
+// >= white / <= black count as white / black, as after a lossy snap.
+template <int BS>
+inline std::uint64_t blockBits(const unsigned char* px, unsigned char white, unsigned char black)
+{
+    bool allWhite = true;
+    bool allBlack = true;
+    for (int k = 0; k < BS; ++k)
+    {
+        allWhite &= (px[k] >= white);
+        allBlack &= (px[k] <= black);
+    }
+    if (allWhite)
+        return TagBits::WhiteLen;
+    if (allBlack)
+        return TagBits::BlackLen;
+    return TagBits::LiterLen + BS * kBitsPerByte;
+}
+
+// Copies the trailing partial block of a row, padded like the encoder pads.
+template <int BS>
+inline const unsigned char* tailBlock(const unsigned char* row, int x, int width, unsigned char (&px)[BS])
+{
+    for (int k = 0; k < BS; ++k)
+        px[k] = (x + k < width) ? row[x + k] : kPadPixelForCoding;
+    return px;
+}
+
+template <int BS>
+void encodeRows(const RawImageData& img, const std::vector<bool>& nonEmpty, int y0, int y1,
+                BitWriter& bw, BlockStats& counts)
+{
+    const int W = img.width;
+    const int fullBlocks = W / BS;
+    for (int y = y0; y < y1; ++y)
     {
         if (!nonEmpty[y])
+        {
+            ++counts.emptyRows;
             continue;
-        const unsigned char* row = img.data + y * W;
-        const int groups = ceilDiv(W, kPixelsPerBlock);
+        }
+        const unsigned char* row = img.data + std::size_t(y) * W;
+        unsigned char pad[BS];
+        const int groups = ceilDiv(W, BS);
         for (int g = 0; g < groups; ++g)
         {
-            unsigned char px[kPixelsPerBlock];
-            for (int k = 0; k < kPixelsPerBlock; ++k)
+            const unsigned char* px = (g < fullBlocks) ? row + g * BS : tailBlock<BS>(row, g * BS, W, pad);
+            bool allWhite = true;
+            bool allBlack = true;
+            for (int k = 0; k < BS; ++k)
             {
-                int x = g * kPixelsPerBlock + k;
-                px[k] = (x < W) ? row[x] : kPadPixelForCoding;
+                allWhite &= (px[k] == kWhite);
+                allBlack &= (px[k] == kBlack);
             }
-            bool allWhite = (px[0]==kWhite && px[1]==kWhite && px[2]==kWhite && px[3]==kWhite);
-            bool allBlack = (px[0]==kBlack && px[1]==kBlack && px[2]==kBlack && px[3]==kBlack);
             if (allWhite)
+            {
                 bw.putBits(TagBits::WhiteVal, TagBits::WhiteLen);
-            else if (allBlack)
+                ++counts.whiteBlocks;
+            } else if (allBlack)
+            {
                 bw.putBits(TagBits::BlackVal, TagBits::BlackLen);
-            else
+                ++counts.blackBlocks;
+            } else
             {
                 bw.putBits(TagBits::LiterVal, TagBits::LiterLen);
-                bw.putByte(px[0]); bw.putByte(px[1]); bw.putByte(px[2]); bw.putByte(px[3]);
+                ++counts.literalBlocks;
+                for (int k = 0; k < BS; ++k)
+                    bw.putByte(px[k]);
             }
         }
     }
-    std::vector<std::uint8_t> bitstream = bw.finish();
+}
+
+template <int BS, bool Checked>
+void decodeRow(unsigned char* row, std::uint32_t W, BitReader& br, BlockStats& counts)
+{
+    std::uint32_t written = 0;
+    while (written < W)
+    {
+        const int b0 = br.getBit<Checked>();
+        const int code = (b0 == 0) ? 0 : (2 | br.getBit<Checked>()); // 0, 2, or 3
+        const std::uint32_t n = std::min<std::uint32_t>(BS, W - written);
 
-    constexpr std::size_t kOffMagic0       = 0;
-    constexpr std::size_t kOffMagic1       = 1;
-    constexpr std::size_t kOffVersion      = 2;
-    constexpr std::size_t kOffWidth        = 3;
-    constexpr std::size_t kOffHeight       = 7;
-    constexpr std::size_t kOffRowIndexSize = 11;
-    constexpr std::size_t kOffDataSize     = 15;
-    constexpr std::size_t kHeaderSize      = 19;
+        switch (code)
+        {
+            case 0: std::memset(row + written, kWhite, n); written += n; ++counts.whiteBlocks; break;
+            case 2: std::memset(row + written, kBlack, n); written += n; ++counts.blackBlocks; break;
+            case 3:
+            {
+                ++counts.literalBlocks;
+                unsigned char p[BS];
+                for (int k = 0; k < BS; ++k)
+                    p[k] = br.getByte<Checked>();
+                std::memcpy(row + written, p, n);
+                written += n;
+            } break;
+            default: {
+                qDebug() << "decode: invalid tag";
+                throw std::runtime_error("decode: invalid tag");}
+        }
+    }
+}
 
-    std::vector<std::uint8_t> file;
-    file.reserve(kHeaderSize + rowIndex.size() + bitstream.size());
+template <int BS>
+void decodeBand(const Band& band, std::uint32_t W, const std::uint8_t* rowIndex, unsigned char* out,
+                BlockStats& counts)
+{
+    // A checksum proves the band is intact, not that it is well formed, so
+    // a row only skips the per-bit checks when even all-literal blocks
+    // cannot run past the band.
+    const std::size_t worstRowBits = std::size_t(ceilDiv<std::uint32_t>(W, BS)) * (TagBits::LiterLen + BS * kBitsPerByte);
+    BitReader br(band.data, band.size);
+    for (std::uint32_t y = band.y0; y < band.y1; ++y)
+    {
+        bool empty = (rowIndex[y / kBitsPerByte] >> (y % kBitsPerByte)) & 1;
+        unsigned char* row = out + std::size_t(y) * W;
+        if (empty)
+        {
+            std::memset(row, kWhite, W);
+            ++counts.emptyRows;
+            continue;
+        }
+        if (br.bitsLeft() >= worstRowBits)
+            decodeRow<BS, false>(row, W, br, counts);
+        else
+            decodeRow<BS, true>(row, W, br, counts);
+    }
+}
+
+// Estimated bitstream size for block size BS over every `step`-th row.
+template <int BS>
+std::uint64_t sampleBits(const RawImageData& img, const std::vector<bool>& nonEmpty, int step,
+                         unsigned char white, unsigned char black)
+{
+    const int W = img.width;
+    const int fullBlocks = W / BS;
+    std::uint64_t bits = 0;
+    for (int y = 0; y < img.height; y += step)
+    {
+        if (!nonEmpty[y])
+            continue;
+        const unsigned char* row = img.data + std::size_t(y) * W;
+        unsigned char pad[BS];
+        const int groups = ceilDiv(W, BS);
+        for (int g = 0; g < groups; ++g)
+            bits += blockBits<BS>((g < fullBlocks) ? row + g * BS : tailBlock<BS>(row, g * BS, W, pad),
+                                  white, black);
+    }
+    return bits;
+}
+
+constexpr int kSampleRows = 64;
+// "Fastest" accepts a larger block while it costs at most this much extra size.
+constexpr double kFastestSlack = 1.10;
 
+int chooseBlockSize(const RawImageData& img, const std::vector<bool>& nonEmpty, const barch::EncodeOptions& opt)
+{
+    if (opt.policy == barch::BlockSizePolicy::Fixed)
+        return opt.blockSize;
+
+    // Lossy estimates see the image as it will be after the snap.
+    const unsigned char white = opt.lossy ? opt.whiteThreshold : kWhite;
+    const unsigned char black = opt.lossy ? opt.blackThreshold : kBlack;
+    const int step = std::max(1, img.height / kSampleRows);
+    const int sizes[] = { 4, 8, 16 };
+    const std::uint64_t bits[] = { sampleBits<4>(img, nonEmpty, step, white, black),
+                                   sampleBits<8>(img, nonEmpty, step, white, black),
+                                   sampleBits<16>(img, nonEmpty, step, white, black) };
+    int best = 0;
+    for (int i = 1; i < 3; ++i)
+        if (bits[i] < bits[best])
+            best = i;
+    if (opt.policy == barch::BlockSizePolicy::Fastest)
+    {
+        // larger blocks mean fewer tags to emit and parse
+        for (int i = 2; i > best; --i)
+            if (double(bits[i]) <= double(bits[best]) * kFastestSlack)
+                return sizes[i];
+    }
+    return sizes[best];
+}
+
+void encodeImpl(const RawImageData& img, std::vector<std::uint8_t>& file, const barch::EncodeOptions& opt,
+                BlockStats* stats, std::uint8_t flags, std::uint32_t refHash)
+{
+    const int W = img.width;
+    const int H = img.height;
+    const int rowIndexBytes = ceilDiv(H, kBitsPerByte);
+
+    std::vector<bool> nonEmpty(H, false);
+    for (int y = 0; y < H; ++y)
+        nonEmpty[y] = !isRowEmpty(img.data + std::size_t(y) * W, W);
+    const int blockSize = chooseBlockSize(img, nonEmpty, opt);
+
+    file.clear();
     file.push_back(static_cast<std::uint8_t>(kMagic0));
     file.push_back(static_cast<std::uint8_t>(kMagic1));
     file.push_back(kFileVersion);
     writeLE32(file, static_cast<std::uint32_t>(W));
     writeLE32(file, static_cast<std::uint32_t>(H));
-    writeLE32(file, static_cast<std::uint32_t>(rowIndex.size()));
-    writeLE32(file, static_cast<std::uint32_t>(bitstream.size()));
+    writeLE32(file, static_cast<std::uint32_t>(rowIndexBytes));
+    writeLE32(file, 0); // data size, patched below
+    file.push_back(static_cast<std::uint8_t>(blockSize));
+    file.push_back(flags);
+    writeLE32(file, refHash);
+    writeLE32(file, kBandRows);
+    writeLE32(file, 0); // header CRC, patched below
 
-    file.insert(file.end(), rowIndex.begin(), rowIndex.end());
-    file.insert(file.end(), bitstream.begin(), bitstream.end());
-    return file;
+    const std::uint32_t bands = ceilDiv<std::uint32_t>(H, kBandRows);
+    const std::size_t bandTable = kHeaderSize + rowIndexBytes;
+    const std::size_t dataStart = bandTable + std::size_t(bands) * kBandEntrySize;
+    file.resize(dataStart, 0);
+    std::uint8_t* rowIndex = file.data() + kHeaderSize;
+    for (int y = 0; y < H; ++y)
+        if (!nonEmpty[y])
+            rowIndex[y / kBitsPerByte] |= (1u << (y % kBitsPerByte));
+
+    BlockStats counts;
+    BitWriter bw(file);
+    for (std::uint32_t b = 0; b < bands; ++b)
+    {
+        const int y0 = int(b * kBandRows);
+        const int y1 = std::min(H, y0 + int(kBandRows));
+        switch (blockSize)
+        {
+            case 4:  encodeRows<4>(img, nonEmpty, y0, y1, bw, counts); break;
+            case 8:  encodeRows<8>(img, nonEmpty, y0, y1, bw, counts); break;
+            case 16: encodeRows<16>(img, nonEmpty, y0, y1, bw, counts); break;
+        }
+        bw.finish(); // bands start byte-aligned
+        patchLE32(file.data() + bandTable + b * kBandEntrySize, static_cast<std::uint32_t>(file.size() - dataStart));
+    }
+    if (stats)
+        *stats = counts;
+
+    const std::size_t dataSize = file.size() - dataStart;
+    patchLE32(file.data() + kOffDataSize, static_cast<std::uint32_t>(dataSize));
+
+    std::uint32_t begin = 0;
+    for (std::uint32_t b = 0; b < bands; ++b)
+    {
+        std::uint8_t* entry = file.data() + bandTable + b * kBandEntrySize;
+        const std::uint32_t end = readLE32(entry);
+        patchLE32(entry + 4, crc::crc32c(file.data() + dataStart + begin, end - begin));
+        begin = end;
+    }
+    std::uint32_t crc = crc::crc32c(file.data(), kOffHeaderCrc);
+    crc = crc::crc32c(file.data() + kHeaderSize, dataStart - kHeaderSize, crc);
+    patchLE32(file.data() + kOffHeaderCrc, crc);
 }
 
-RawImageData decode(const std::uint8_t* bytes, std::size_t size)
+RawImageData decodeImpl(const std::uint8_t* bytes, std::size_t size, BlockStats* stats, const RawImageData* reference)
 {
-    constexpr std::size_t kOffMagic0       = 0;
-    constexpr std::size_t kOffMagic1       = 1;
-    constexpr std::size_t kOffVersion      = 2;
-    constexpr std::size_t kOffWidth        = 3;
-    constexpr std::size_t kOffHeight       = 7;
-    constexpr std::size_t kOffRowIndexSize = 11;
-    constexpr std::size_t kOffDataSize     = 15;
-    constexpr std::size_t kHeaderSize      = 19;
+    const Header hdr = readHeader(bytes, size);
+    checkLayout(hdr, bytes, size);
 
-    if (!bytes || size < kHeaderSize)
+    const bool delta = hdr.flags & kFlagDelta;
+    if (delta)
     {
-        qDebug() << "decode: too small";
-        throw std::runtime_error("decode: too small");
+        if (!reference || !reference->data)
+        {
+            qDebug() << "decode: delta image needs its reference";
+            throw std::runtime_error("decode: delta image needs its reference");
+        }
+        if (std::uint32_t(reference->width) != hdr.width || std::uint32_t(reference->height) != hdr.height
+            || fingerprint(*reference) != hdr.refHash)
+        {
+            qDebug() << "decode: reference does not match";
+            throw std::runtime_error("decode: reference does not match");
+        }
     }
-    if (bytes[kOffMagic0] != kMagic0 || bytes[kOffMagic1] != kMagic1)
+
+    // Check every band before allocating the output: a corrupt file fails
+    // after a pass over its compressed bytes, not partway into W*H.
+    if (hdr.hasBandTable)
+        for (std::uint32_t b = 0; b < hdr.bands; ++b)
+            bandAt(hdr, bytes, b, true);
+
+    const std::uint8_t* rowIndex = bytes + hdr.headerSize;
+
+    const std::size_t total = static_cast<std::size_t>(hdr.width) * static_cast<std::size_t>(hdr.height);
+    std::unique_ptr<unsigned char[]> outData(new unsigned char[total]);
+
+    BlockStats counts;
+    for (std::uint32_t b = 0; b < hdr.bands; ++b)
     {
-        qDebug() << "decode: bad magic";
-        throw std::runtime_error("decode: bad magic");
+        const Band band = bandAt(hdr, bytes, b, false);
+        switch (hdr.blockSize)
+        {
+            case 4:  decodeBand<4>(band, hdr.width, rowIndex, outData.get(), counts); break;
+            case 8:  decodeBand<8>(band, hdr.width, rowIndex, outData.get(), counts); break;
+            case 16: decodeBand<16>(band, hdr.width, rowIndex, outData.get(), counts); break;
+        }
+    }
+    if (delta)
+        xorWithReference(outData.get(), outData.get(), reference->data, total);
+    if (stats)
+        *stats = counts;
+
+    RawImageData img;
+    img.width  = static_cast<int>(hdr.width);
+    img.height = static_cast<int>(hdr.height);
+    img.data   = outData.release();
+    return img;
+}
+
+} // namespace
+
+namespace barch
+{
+
+std::vector<std::uint8_t> encode(const RawImageData& img, const EncodeOptions& opt)
+{
+    std::vector<std::uint8_t> file;
+    encodeTo(img, file, opt);
+    return file;
+}
+
+void encodeTo(const RawImageData& img, std::vector<std::uint8_t>& file, const EncodeOptions& opt, BlockStats* stats)
+{
+    if (!img.data || img.width <= 0 || img.height <= 0)
+    {
+        qDebug() << "encode: invalid input image";
+        throw std::invalid_argument("encode: invalid input image");
     }
-    if (bytes[kOffVersion] != kFileVersion)
+    if (opt.policy == BlockSizePolicy::Fixed && !isSupportedBlockSize(opt.blockSize))
     {
-        qDebug() << "decode: unsupported version";
-        throw std::runtime_error("decode: unsupported version");
+        qDebug() << "encode: unsupported block size";
+        throw std::invalid_argument("encode: unsupported block size");
+    }
+    if (opt.lossy && opt.blackThreshold >= opt.whiteThreshold)
+    {
+        qDebug() << "encode: black threshold must be below white threshold";
+        throw std::invalid_argument("encode: black threshold must be below white threshold");
     }
 
-    const std::uint32_t W            = readLE32(bytes + kOffWidth);
-    const std::uint32_t H            = readLE32(bytes + kOffHeight);
-    const std::uint32_t rowIndexByte = readLE32(bytes + kOffRowIndexSize);
-    const std::uint32_t dataBytes    = readLE32(bytes + kOffDataSize);
+    const RawImageData* ref = opt.reference;
+    const bool delta = ref && ref->data && sameSize(*ref, img);
+    if (!opt.lossy && !delta)
+    {
+        encodeImpl(img, file, opt, stats, 0, 0);
+        return;
+    }
 
-    const std::size_t need = kHeaderSize + rowIndexByte + dataBytes;
-    if (size < need)
+    // Both pre-passes run over one scratch copy; the caller's image is untouched.
+    const std::size_t total = std::size_t(img.width) * std::size_t(img.height);
+    std::unique_ptr<unsigned char[]> scratch(new unsigned char[total]);
+    const unsigned char* src = img.data;
+    EncodeOptions coded = opt;
+    if (opt.lossy)
     {
-        qDebug() << "decode: truncated file";
-        throw std::runtime_error("decode: truncated file");
+        // Snap whole blocks of the size the image is coded with, so literal
+        // blocks keep their exact values; the size is fixed from here on.
+        std::vector<bool> nonEmpty(img.height);
+        for (int y = 0; y < img.height; ++y)
+            nonEmpty[y] = !isRowEmpty(img.data + std::size_t(y) * img.width, img.width, opt.whiteThreshold);
+        coded.blockSize = chooseBlockSize(img, nonEmpty, opt);
+        coded.policy = BlockSizePolicy::Fixed;
+        gray::snapBlocks(src, scratch.get(), img.width, img.height, coded.blockSize,
+                         opt.whiteThreshold, opt.blackThreshold);
+        src = scratch.get();
+    }
+    if (delta)
+        xorWithReference(scratch.get(), src, ref->data, total);
+    encodeImpl(RawImageData{ img.width, img.height, scratch.get() }, file, coded, stats,
+               delta ? kFlagDelta : 0, delta ? fingerprint(*ref) : 0);
+}
+
+RawImageData decode(const std::uint8_t* bytes, std::size_t size, BlockStats* stats)
+{
+    return decodeImpl(bytes, size, stats, nullptr);
+}
+
+RawImageData decode(const std::uint8_t* bytes, std::size_t size, const RawImageData& reference, BlockStats* stats)
+{
+    return decodeImpl(bytes, size, stats, &reference);
+}
+
+RawImageData decodeThumbnail(const std::uint8_t* bytes, std::size_t size, int maxWidth, int maxHeight)
+{
+    if (maxWidth <= 0 || maxHeight <= 0)
+    {
+        qDebug() << "decodeThumbnail: invalid target size";
+        throw std::invalid_argument("decodeThumbnail: invalid target size");
+    }
+    const Header hdr = readHeader(bytes, size);
+    checkLayout(hdr, bytes, size);
+    if (hdr.flags & kFlagDelta)
+    {
+        qDebug() << "decodeThumbnail: delta image needs its reference";
+        throw std::runtime_error("decodeThumbnail: delta image needs its reference");
     }
 
-    const std::uint8_t* rowIndex = bytes + kHeaderSize;
-    const std::uint8_t* data     = rowIndex + rowIndexByte;
+    const std::uint32_t W = hdr.width;
+    const std::uint32_t H = hdr.height;
+    if (W == 0 || H == 0)
+    {
+        qDebug() << "decodeThumbnail: empty image";
+        throw std::runtime_error("decodeThumbnail: empty image");
+    }
 
-    const std::size_t total = static_cast<std::size_t>(W) * static_cast<std::size_t>(H);
-    auto* outData = new unsigned char[total];
+    // Fit into maxWidth x maxHeight keeping the aspect ratio, never upscale.
+    const double scale = std::min({ 1.0, double(maxWidth) / W, double(maxHeight) / H });
+    const std::uint32_t TW = std::max<std::uint32_t>(1, std::uint32_t(W * scale));
+    const std::uint32_t TH = std::max<std::uint32_t>(1, std::uint32_t(H * scale));
 
-    BitReader br(data, dataBytes);
-    for (std::uint32_t y = 0; y < H; ++y)
+    // A block adds to every thumbnail column it overlaps: its pixels are
+    // split into runs that fall in one column each, so the inner loops add
+    // whole runs. Block g covers spans [spanBegin[g], spanBegin[g + 1]);
+    // padding past the image edge is skipped.
+    struct Span
     {
-        bool empty = (rowIndex[y / kBitsPerByte] >> (y % kBitsPerByte)) & 1;
-        unsigned char* row = outData + y * W;
-        if (empty)
-            std::memset(row, kWhite, W); continue;
+        std::uint32_t col;
+        std::uint32_t pixels;
+    };
+    const std::uint32_t bs = static_cast<std::uint32_t>(hdr.blockSize);
+    const std::uint32_t groups = ceilDiv<std::uint32_t>(W, bs);
+    std::vector<Span> spans;
+    std::vector<std::uint32_t> spanBegin(groups + 1);
+    std::vector<std::uint32_t> colPixels(TW, 0);
+    for (std::uint32_t g = 0; g < groups; ++g)
+    {
+        spanBegin[g] = static_cast<std::uint32_t>(spans.size());
+        const std::uint32_t x1 = std::min(W, (g + 1) * bs);
+        for (std::uint32_t x = g * bs; x < x1; ++x)
+        {
+            const std::uint32_t col = std::uint32_t(std::uint64_t(x) * TW / W);
+            if (spans.size() > spanBegin[g] && spans.back().col == col)
+                ++spans.back().pixels;
+            else
+                spans.push_back({ col, 1 });
+            ++colPixels[col];
+        }
+    }
+    spanBegin[groups] = static_cast<std::uint32_t>(spans.size());
+
+    const std::uint8_t* rowIndex = bytes + hdr.headerSize;
+
+    auto* outData = new unsigned char[std::size_t(TW) * TH];
+    std::vector<std::uint32_t> sums(TW, 0);
+    std::uint32_t bandRows = 0;
+    std::uint32_t band = 0;
 
-        std::uint32_t written = 0;
-        while (written < W)
+    auto flushBand = [&]() {
+        unsigned char* dst = outData + std::size_t(band) * TW;
+        for (std::uint32_t tx = 0; tx < TW; ++tx)
         {
-            const int b0 = br.getBit();
-            const int code = (b0 == 0) ? 0 : (2 | br.getBit()); // 0, 2, or 3
-            const std::uint32_t n = std::min<std::uint32_t>(kPixelsPerBlock, W - written);
+            const std::uint32_t n = colPixels[tx] * bandRows;
+            dst[tx] = n ? static_cast<unsigned char>(sums[tx] / n) : kWhite;
+            sums[tx] = 0;
+        }
+        bandRows = 0;
+    };
+
+    try {
+        Band src = bandAt(hdr, bytes, 0, true);
+        BitReader br(src.data, src.size);
+        for (std::uint32_t y = 0; y < H; ++y)
+        {
+            if (y == src.y1)
+            {
+                src = bandAt(hdr, bytes, y / hdr.bandRows, true);
+                br = BitReader(src.data, src.size);
+            }
+            const std::uint32_t ty = std::uint32_t(std::uint64_t(y) * TH / H);
+            if (ty != band)
+            {
+                flushBand();
+                band = ty;
+            }
+            ++bandRows;
 
-            switch (code)
+            const bool empty = (rowIndex[y / kBitsPerByte] >> (y % kBitsPerByte)) & 1;
+            if (empty)
             {
-                case 0: std::memset(row + written, kWhite, n); written += n; break;
-                case 2: std::memset(row + written, kBlack, n); written += n; break;
-                case 3:
+                for (std::uint32_t tx = 0; tx < TW; ++tx)
+                    sums[tx] += kWhite * colPixels[tx];
+                continue;
+            }
+
+            for (std::uint32_t g = 0; g < groups; ++g)
+            {
+                if (br.getBit() == 0)
+                {
+                    for (std::uint32_t s = spanBegin[g]; s < spanBegin[g + 1]; ++s)
+                        sums[spans[s].col] += kWhite * spans[s].pixels;
+                } else if (br.getBit() == 0)
                 {
-                    unsigned char p[kPixelsPerBlock] = { br.getByte(), br.getByte(), br.getByte(), br.getByte() };
-                    std::memcpy(row + written, p, n);
-                    written += n;
-                } break;
-                default: {
-                    qDebug() << "decode: invalid tag";
-                    throw std::runtime_error("decode: invalid tag");}
+                    // black contributes nothing to the sum
+                } else
+                {
+                    std::uint32_t read = 0;
+                    for (std::uint32_t s = spanBegin[g]; s < spanBegin[g + 1]; ++s)
+                    {
+                        std::uint32_t acc = 0;
+                        for (std::uint32_t k = 0; k < spans[s].pixels; ++k)
+                            acc += br.getByte();
+                        sums[spans[s].col] += acc;
+                        read += spans[s].pixels;
+                    }
+                    for (; read < bs; ++read)
+                        br.getByte(); // padding
+                }
             }
         }
+        flushBand();
+    } catch (...) {
+        delete[] outData;
+        throw;
     }
 
     RawImageData img;
-    img.width  = static_cast<int>(W);
-    img.height = static_cast<int>(H);
+    img.width  = static_cast<int>(TW);
+    img.height = static_cast<int>(TH);
     img.data   = outData;
     return img;
 }
 
-void saveToFile(const std::string& path, const RawImageData& img)
+void saveToFile(const std::string& path, const RawImageData& img, const EncodeOptions& opt)
 {
-    auto bytes = encode(img);
+    auto bytes = encode(img, opt);
     std::ofstream f(path, std::ios::binary);
     if (!f)
     {
@@ -307,13 +936,19 @@ void saveToFile(const std::string& path, const RawImageData& img)
 
 RawImageData loadFromFile(const std::string& path)
 {
-    std::ifstream f(path, std::ios::binary);
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
     if (!f)
     {
         qDebug() << "loadFromFile: cannot open";
         throw std::runtime_error("loadFromFile: cannot open");
     }
-    std::vector<std::uint8_t> buf((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    std::vector<std::uint8_t> buf(static_cast<std::size_t>(std::max<std::streamoff>(0, f.tellg())));
+    f.seekg(0, std::ios::beg);
+    if (!f.read(reinterpret_cast<char*>(buf.data()), static_cast<std::streamsize>(buf.size())))
+    {
+        qDebug() << "loadFromFile: read failed";
+        throw std::runtime_error("loadFromFile: read failed");
+    }
     if (buf.empty())
     {
         qDebug() << "loadFromFile: empty file";
@@ -322,6 +957,104 @@ RawImageData loadFromFile(const std::string& path)
     return decode(buf.data(), buf.size());
 }
 
+BarchInfo peekInfo(const std::string& path)
+{
+    std::ifstream f(path, std::ios::binary);
+    if (!f)
+    {
+        qDebug() << "peekInfo: cannot open";
+        throw std::runtime_error("peekInfo: cannot open");
+    }
+    std::vector<std::uint8_t> head(kHeaderSize);
+    f.read(reinterpret_cast<char*>(head.data()), kHeaderSize);
+    const std::size_t got = static_cast<std::size_t>(f.gcount());
+    const Header hdr = readHeader(head.data(), got);
+
+    const std::size_t want = hdr.headerSize + hdr.rowIndexSize;
+    head.resize(std::max(want, got));
+    if (want > got)
+    {
+        f.clear();
+        f.read(reinterpret_cast<char*>(head.data() + got), static_cast<std::streamsize>(want - got));
+        if (!f)
+        {
+            qDebug() << "peekInfo: truncated row index";
+            throw std::runtime_error("peekInfo: truncated row index");
+        }
+    }
+    return peekInfo(head.data(), head.size());
+}
+
+BarchInfo peekInfo(const std::uint8_t* bytes, std::size_t size)
+{
+    const Header hdr = readHeader(bytes, size);
+    if (size < hdr.headerSize + std::size_t(hdr.rowIndexSize))
+    {
+        qDebug() << "peekInfo: truncated row index";
+        throw std::runtime_error("peekInfo: truncated row index");
+    }
+
+    BarchInfo info;
+    info.width        = static_cast<int>(hdr.width);
+    info.height       = static_cast<int>(hdr.height);
+    info.rowIndexSize = hdr.rowIndexSize;
+    info.dataSize     = hdr.dataSize;
+    info.emptyRows    = countEmptyRows(bytes + hdr.headerSize, hdr.height);
+    info.blockSize    = hdr.blockSize;
+    info.delta        = hdr.flags & kFlagDelta;
+    info.bands        = hdr.hasBandTable ? int(hdr.bands) : 0;
+    return info;
+}
+
+VerifyResult verify(const std::uint8_t* bytes, std::size_t size)
+{
+    VerifyResult res;
+    try {
+        const Header hdr = readHeader(bytes, size);
+        checkLayout(hdr, bytes, size);
+        for (std::uint32_t b = 0; b < hdr.bands; ++b)
+            bandAt(hdr, bytes, b, hdr.hasBandTable);
+        res.ok = true;
+        res.checksummed = hdr.hasBandTable;
+        res.bands = hdr.hasBandTable ? int(hdr.bands) : 0;
+    } catch (const std::exception& e) {
+        res.error = e.what();
+    }
+    return res;
+}
+
+VerifyResult verify(const std::string& path)
+{
+    // Mapped, not read: checksumming then runs straight over the page cache.
+    VerifyResult res;
+    QFile f(QString::fromStdString(path));
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        res.error = "verify: cannot open";
+        return res;
+    }
+    const qint64 size = f.size();
+    if (size <= 0)
+    {
+        res.error = "decode: too small";
+        return res;
+    }
+    uchar* p = f.map(0, size);
+    if (!p)
+    {
+        res.error = "verify: map failed";
+        return res;
+    }
+    res = verify(static_cast<const std::uint8_t*>(p), static_cast<std::size_t>(size));
+    f.unmap(p);
+    return res;
+}
+
+std::uint32_t referenceFingerprint(const RawImageData& reference)
+{
+    return fingerprint(reference);
+}
+
 void freeImage(RawImageData& img)
 {
     delete[] img.data;
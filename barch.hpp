@@ -10,11 +10,88 @@ struct RawImageData
     unsigned char* data;
 };
 
+// Header fields plus the number of rows flagged empty in the row index.
+struct BarchInfo
+{
+    int width = 0;
+    int height = 0;
+    std::uint32_t rowIndexSize = 0;
+    std::uint32_t dataSize = 0;
+    int emptyRows = 0;
+    int blockSize = 4;
+    bool delta = false; // needs its reference image to decode
+    int bands = 0;      // CRC-checked bands; 0 for files before version 4
+};
+
+// Outcome of barch::verify(); `error` names the first check that failed.
+struct VerifyResult
+{
+    bool ok = false;
+    bool checksummed = false; // false for files before version 4: sizes only
+    int bands = 0;
+    std::string error;
+};
+
+// Block tag and empty-row counts seen by one encode or decode.
+struct BlockStats
+{
+    std::uint64_t whiteBlocks = 0;
+    std::uint64_t blackBlocks = 0;
+    std::uint64_t literalBlocks = 0;
+    std::uint64_t emptyRows = 0;
+};
+
 namespace barch
 {
-std::vector<std::uint8_t> encode(const RawImageData& img);
-RawImageData decode(const std::uint8_t* bytes, std::size_t size);
-void saveToFile(const std::string& path, const RawImageData& img);
+
+enum class BlockSizePolicy
+{
+    Fixed,    // use EncodeOptions::blockSize
+    Smallest, // sample the image, pick the size with the smallest estimate
+    Fastest   // largest block within 10% of the smallest estimate
+};
+
+struct EncodeOptions
+{
+    int blockSize = 4; // pixels per block: 4, 8 or 16
+    BlockSizePolicy policy = BlockSizePolicy::Fixed;
+    // When set and the same size as the image, store the image as a
+    // difference against it: unchanged pixels code as white blocks and
+    // unchanged rows as empty rows. Not owned; only read during the call.
+    const RawImageData* reference = nullptr;
+    // Lossy: before coding, every block whose pixels are all >= whiteThreshold
+    // becomes white and every block whose pixels are all <= blackThreshold
+    // black, so noisy paper codes as white blocks and empty rows instead of
+    // literals. Literal blocks keep their exact values. Requires
+    // blackThreshold < whiteThreshold.
+    bool lossy = false;
+    std::uint8_t whiteThreshold = 0xF0;
+    std::uint8_t blackThreshold = 0x0F;
+};
+
+std::vector<std::uint8_t> encode(const RawImageData& img, const EncodeOptions& opt = {});
+// Same as encode(), but writes into `out` (cleared first) to reuse its capacity.
+void encodeTo(const RawImageData& img, std::vector<std::uint8_t>& out,
+              const EncodeOptions& opt = {}, BlockStats* stats = nullptr);
+// Throws on delta images; those need the overload taking their reference.
+RawImageData decode(const std::uint8_t* bytes, std::size_t size, BlockStats* stats = nullptr);
+// Decodes delta and plain images alike; the reference is checked against the
+// fingerprint stored at encode time and ignored for plain images.
+RawImageData decode(const std::uint8_t* bytes, std::size_t size, const RawImageData& reference,
+                    BlockStats* stats = nullptr);
+// Box-filtered preview no larger than maxWidth x maxHeight, decoded straight
+// from the bitstream without materialising the full-size image.
+RawImageData decodeThumbnail(const std::uint8_t* bytes, std::size_t size, int maxWidth, int maxHeight);
+void saveToFile(const std::string& path, const RawImageData& img, const EncodeOptions& opt = {});
 RawImageData loadFromFile(const std::string& path);
+// Reads only the header and row index, never the bitstream.
+BarchInfo peekInfo(const std::string& path);
+BarchInfo peekInfo(const std::uint8_t* bytes, std::size_t size);
+// Checks header, sizes, header CRC and every band CRC without decoding
+// pixels. Never throws.
+VerifyResult verify(const std::uint8_t* bytes, std::size_t size);
+VerifyResult verify(const std::string& path);
+// 32-bit fingerprint a delta encode stores to identify its reference.
+std::uint32_t referenceFingerprint(const RawImageData& reference);
 void freeImage(RawImageData& img);
 } // namespace barch
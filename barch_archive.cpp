@@ -0,0 +1,348 @@
+#include "barch_archive.h"
+
+#include <QFile>
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+namespace {
+
+constexpr char kArchiveMagic[4] = { 'B', 'A', 'R', 'X' };
+constexpr char kFooterMagicV1[4] = { 'B', 'X', 'I', 'X' }; // no source stamps
+constexpr char kFooterMagic[4]  = { 'B', 'X', 'I', '2' };
+constexpr std::uint8_t kArchiveVersion = 0x01;
+constexpr std::uint64_t kArchiveHeaderSize = 5;
+constexpr std::uint64_t kFooterSize = 16;
+constexpr std::size_t kMaxNameLen = 0xFFFF;
+
+template <typename T>
+void putLE(std::vector<std::uint8_t>& buf, T v)
+{
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+        buf.push_back(static_cast<std::uint8_t>(v >> (i * 8)));
+}
+
+template <typename T>
+T getLE(const std::uint8_t* p)
+{
+    T v = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+        v |= T(p[i]) << (i * 8);
+    return v;
+}
+
+[[noreturn]] void fail(const char* msg)
+{
+    qDebug() << msg;
+    throw std::runtime_error(msg);
+}
+
+std::string journalPath(const std::string& path)
+{
+    return path + ".journal";
+}
+
+// Length of the archive as of its last close(): the journalled length while
+// an append is in flight or was interrupted, else the file size.
+std::uint64_t committedSize(const std::string& path, std::uint64_t fileSize)
+{
+    std::ifstream j(journalPath(path), std::ios::binary);
+    std::uint8_t buf[8];
+    if (!j || !j.read(reinterpret_cast<char*>(buf), sizeof(buf)))
+        return fileSize;
+    return std::min(fileSize, getLE<std::uint64_t>(buf));
+}
+
+// Undoes an append that never reached close(). A journal that was not
+// written completely predates any append, so it is just dropped.
+void recover(const std::string& path)
+{
+    const std::string journal = journalPath(path);
+    std::error_code ec;
+    if (!std::filesystem::exists(journal, ec))
+        return;
+    if (std::filesystem::file_size(journal, ec) == 8 && std::filesystem::exists(path, ec))
+    {
+        const std::uint64_t size = std::filesystem::file_size(path, ec);
+        const std::uint64_t committed = committedSize(path, size);
+        if (!ec && committed < size)
+        {
+            std::filesystem::resize_file(path, committed, ec);
+            if (ec)
+                fail("archive: cannot roll back interrupted append");
+        }
+    }
+    std::filesystem::remove(journal, ec);
+    if (ec)
+        fail("archive: cannot remove journal");
+}
+
+// Reads footer and index of an archive that ends at `fileSize`; returns the
+// offset where the index starts.
+std::uint64_t readIndex(std::istream& f, std::uint64_t fileSize, std::vector<barch::ArchiveEntry>& out)
+{
+    if (fileSize < kArchiveHeaderSize + kFooterSize)
+        fail("archive: too small");
+
+    char head[kArchiveHeaderSize];
+    f.seekg(0, std::ios::beg);
+    f.read(head, sizeof(head));
+    if (!f || std::memcmp(head, kArchiveMagic, 4) != 0)
+        fail("archive: bad magic");
+    if (static_cast<std::uint8_t>(head[4]) != kArchiveVersion)
+        fail("archive: unsupported version");
+
+    std::uint8_t footer[kFooterSize];
+    f.seekg(static_cast<std::streamoff>(fileSize - kFooterSize), std::ios::beg);
+    f.read(reinterpret_cast<char*>(footer), sizeof(footer));
+    if (!f)
+        fail("archive: bad footer");
+    const bool withSource = std::memcmp(footer + 12, kFooterMagic, 4) == 0;
+    if (!withSource && std::memcmp(footer + 12, kFooterMagicV1, 4) != 0)
+        fail("archive: bad footer");
+    const std::size_t fixedLen = withSource ? 48 : 24;
+    const std::uint64_t indexOffset = getLE<std::uint64_t>(footer);
+    const std::uint32_t count = getLE<std::uint32_t>(footer + 8);
+    if (indexOffset < kArchiveHeaderSize || indexOffset > fileSize - kFooterSize)
+        fail("archive: bad index offset");
+
+    std::vector<std::uint8_t> index(fileSize - kFooterSize - indexOffset);
+    f.seekg(static_cast<std::streamoff>(indexOffset), std::ios::beg);
+    f.read(reinterpret_cast<char*>(index.data()), static_cast<std::streamsize>(index.size()));
+    if (!f)
+        fail("archive: index read failed");
+
+    out.clear();
+    out.reserve(count);
+    std::size_t pos = 0;
+    for (std::uint32_t i = 0; i < count; ++i)
+    {
+        if (index.size() - pos < 2)
+            fail("archive: truncated index");
+        const std::size_t nameLen = getLE<std::uint16_t>(index.data() + pos);
+        pos += 2;
+        if (index.size() - pos < nameLen + fixedLen)
+            fail("archive: truncated index");
+        barch::ArchiveEntry e;
+        e.name.assign(reinterpret_cast<const char*>(index.data() + pos), nameLen);
+        pos += nameLen;
+        e.offset = getLE<std::uint64_t>(index.data() + pos);
+        e.size   = getLE<std::uint64_t>(index.data() + pos + 8);
+        e.width  = static_cast<int>(getLE<std::uint32_t>(index.data() + pos + 16));
+        e.height = static_cast<int>(getLE<std::uint32_t>(index.data() + pos + 20));
+        if (withSource)
+        {
+            e.source.size    = getLE<std::uint64_t>(index.data() + pos + 24);
+            e.source.mtime   = static_cast<std::int64_t>(getLE<std::uint64_t>(index.data() + pos + 32));
+            e.source.options = getLE<std::uint64_t>(index.data() + pos + 40);
+        }
+        pos += fixedLen;
+        if (e.offset < kArchiveHeaderSize || e.size > indexOffset || e.offset > indexOffset - e.size)
+            fail("archive: entry out of range");
+        out.push_back(std::move(e));
+    }
+    return indexOffset;
+}
+
+} // namespace
+
+namespace barch
+{
+
+ArchiveWriter::~ArchiveWriter()
+{
+    try {
+        close();
+    } catch (const std::exception& e) {
+        qDebug() << "ArchiveWriter: close failed:" << e.what();
+    }
+}
+
+void ArchiveWriter::open(const std::string& path)
+{
+    close();
+    m_entries.clear();
+    m_path = path;
+    m_journalPath = journalPath(path);
+    recover(path);
+
+    std::error_code ec;
+    const std::uint64_t size = std::filesystem::exists(path, ec) ? std::filesystem::file_size(path, ec) : 0;
+    if (size > 0)
+    {
+        std::ifstream old(path, std::ios::binary);
+        if (!old)
+            fail("archive: cannot open");
+        readIndex(old, size, m_entries);
+    }
+
+    // The journal goes first: from here on readers and recover() ignore
+    // everything past `size`.
+    std::vector<std::uint8_t> len;
+    putLE<std::uint64_t>(len, size);
+    std::ofstream journal(m_journalPath, std::ios::binary | std::ios::trunc);
+    journal.write(reinterpret_cast<const char*>(len.data()), static_cast<std::streamsize>(len.size()));
+    journal.close();
+    if (!journal)
+        fail("archive: cannot write journal");
+
+    if (size > 0)
+    {
+        m_file.open(path, std::ios::binary | std::ios::in | std::ios::out);
+        m_file.seekp(static_cast<std::streamoff>(size), std::ios::beg);
+        m_end = size;
+    } else
+    {
+        m_file.open(path, std::ios::binary | std::ios::out | std::ios::trunc);
+        m_file.write(kArchiveMagic, 4);
+        m_file.put(static_cast<char>(kArchiveVersion));
+        m_end = kArchiveHeaderSize;
+    }
+    if (!m_file)
+    {
+        m_file.close();
+        recover(path);
+        fail("archive: cannot open");
+    }
+}
+
+void ArchiveWriter::append(const std::string& name, const RawImageData& img)
+{
+    encodeTo(img, m_scratch);
+    appendEncoded(name, m_scratch.data(), m_scratch.size());
+}
+
+void ArchiveWriter::appendEncoded(const std::string& name, const std::uint8_t* bytes, std::size_t size,
+                                  const SourceStamp& source)
+{
+    if (!m_file.is_open())
+        fail("archive: not open");
+    if (name.size() > kMaxNameLen)
+        fail("archive: name too long");
+    const BarchInfo info = peekInfo(bytes, size);
+
+    m_file.write(reinterpret_cast<const char*>(bytes), static_cast<std::streamsize>(size));
+    if (!m_file)
+        fail("archive: write failed");
+
+    // a repeated name replaces the older entry; its bytes become dead space
+    auto sameName = [&name](const ArchiveEntry& e) { return e.name == name; };
+    m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), sameName), m_entries.end());
+
+    ArchiveEntry e;
+    e.name   = name;
+    e.offset = m_end;
+    e.size   = size;
+    e.width  = info.width;
+    e.height = info.height;
+    e.source = source;
+    m_entries.push_back(std::move(e));
+    m_end += size;
+}
+
+void ArchiveWriter::close()
+{
+    if (!m_file.is_open())
+        return;
+
+    try {
+        std::vector<std::uint8_t> tail;
+        for (const ArchiveEntry& e : m_entries)
+        {
+            putLE<std::uint16_t>(tail, static_cast<std::uint16_t>(e.name.size()));
+            tail.insert(tail.end(), e.name.begin(), e.name.end());
+            putLE<std::uint64_t>(tail, e.offset);
+            putLE<std::uint64_t>(tail, e.size);
+            putLE<std::uint32_t>(tail, static_cast<std::uint32_t>(e.width));
+            putLE<std::uint32_t>(tail, static_cast<std::uint32_t>(e.height));
+            putLE<std::uint64_t>(tail, e.source.size);
+            putLE<std::uint64_t>(tail, static_cast<std::uint64_t>(e.source.mtime));
+            putLE<std::uint64_t>(tail, e.source.options);
+        }
+        putLE<std::uint64_t>(tail, m_end);
+        putLE<std::uint32_t>(tail, static_cast<std::uint32_t>(m_entries.size()));
+        tail.insert(tail.end(), kFooterMagic, kFooterMagic + 4);
+
+        m_file.seekp(static_cast<std::streamoff>(m_end), std::ios::beg);
+        m_file.write(reinterpret_cast<const char*>(tail.data()), static_cast<std::streamsize>(tail.size()));
+        m_file.flush();
+        if (!m_file)
+            fail("archive: index write failed");
+        m_file.close();
+
+        // Dropping the journal commits the new index.
+        std::error_code ec;
+        std::filesystem::remove(m_journalPath, ec);
+        if (ec)
+            fail("archive: cannot remove journal");
+    } catch (...) {
+        m_file.close();
+        recover(m_path);
+        throw;
+    }
+}
+
+std::vector<ArchiveEntry> listArchive(const std::string& path)
+{
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    if (!f)
+        fail("archive: cannot open");
+    std::vector<ArchiveEntry> entries;
+    readIndex(f, committedSize(path, static_cast<std::uint64_t>(f.tellg())), entries);
+    return entries;
+}
+
+// Maps [offset, offset + size) of the archive and hands it to fn.
+template <typename Fn>
+auto withMappedEntry(const std::string& path, const ArchiveEntry& entry, Fn fn)
+{
+    QFile f(QString::fromStdString(path));
+    if (!f.open(QIODevice::ReadOnly))
+        fail("archive: cannot open");
+    if (entry.offset + entry.size > static_cast<std::uint64_t>(f.size()))
+        fail("archive: entry out of range");
+
+    uchar* p = f.map(static_cast<qint64>(entry.offset), static_cast<qint64>(entry.size));
+    if (!p)
+        fail("archive: map failed");
+    try {
+        auto result = fn(static_cast<const std::uint8_t*>(p), static_cast<std::size_t>(entry.size));
+        f.unmap(p);
+        return result;
+    } catch (...) {
+        f.unmap(p);
+        throw;
+    }
+}
+
+RawImageData extractFromArchive(const std::string& path, const ArchiveEntry& entry)
+{
+    return withMappedEntry(path, entry, [](const std::uint8_t* p, std::size_t n) {
+        return decode(p, n);
+    });
+}
+
+VerifyResult verifyArchiveEntry(const std::string& path, const ArchiveEntry& entry)
+{
+    try {
+        return withMappedEntry(path, entry, [](const std::uint8_t* p, std::size_t n) {
+            return verify(p, n);
+        });
+    } catch (const std::exception& e) {
+        VerifyResult res;
+        res.error = e.what();
+        return res;
+    }
+}
+
+void readArchiveEntry(const std::string& path, const ArchiveEntry& entry, std::vector<std::uint8_t>& out)
+{
+    withMappedEntry(path, entry, [&out](const std::uint8_t* p, std::size_t n) {
+        out.assign(p, p + n);
+        return true;
+    });
+}
+
+} // namespace barch
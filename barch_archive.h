@@ -0,0 +1,85 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "barch.hpp"
+
+// Multi-image container (.barx): encoded BARCH images stored back to back,
+// followed by an index and a fixed-size footer.
+//
+//   "BARX" u8 version | blob 0 | blob 1 | ... | index | footer
+//   index entry:  u16 nameLen, name (UTF-8), u64 offset, u64 size, u32 width, u32 height,
+//                 u64 sourceSize, i64 sourceMtime (ms), u64 options
+//   footer:       u64 indexOffset, u32 entryCount, "BXI2"
+//
+// Index entries behind a "BXIX" footer (the first layout) end after height;
+// their source stamp reads as unknown.
+//
+// Reopening appends: new blobs, then a new index and footer, go after the
+// end of the existing file, so adding pages costs only their own bytes.
+// Replaced entries and superseded indexes stay behind as dead space. While
+// a writer is open, "<path>.journal" holds the archive's previous length;
+// readers stop there, and the next open() truncates an append that never
+// reached close(), so a crash or write error leaves the previous archive
+// intact. The index is written once per close(), so appending many pages
+// costs one open and one flush for the whole batch.
+namespace barch
+{
+
+// The source an entry was encoded from, for incremental re-runs, as in
+// stamp::isCurrent(): size and mtime of the file and the caller's key of
+// the encode settings. All zero means unknown.
+struct SourceStamp
+{
+    std::uint64_t size = 0;
+    std::int64_t mtime = 0;
+    std::uint64_t options = 0;
+};
+
+struct ArchiveEntry
+{
+    std::string name;
+    std::uint64_t offset = 0;
+    std::uint64_t size = 0;
+    int width = 0;
+    int height = 0;
+    SourceStamp source;
+};
+
+class ArchiveWriter
+{
+public:
+    ArchiveWriter() = default;
+    ~ArchiveWriter();
+    ArchiveWriter(const ArchiveWriter&) = delete;
+    ArchiveWriter& operator=(const ArchiveWriter&) = delete;
+
+    // Creates the archive or reopens an existing one for appending. An
+    // appended name that is already in the archive replaces that entry.
+    void open(const std::string& path);
+    void append(const std::string& name, const RawImageData& img);
+    // `bytes` must be a complete BARCH image as produced by encode().
+    void appendEncoded(const std::string& name, const std::uint8_t* bytes, std::size_t size,
+                       const SourceStamp& source = {});
+    // Writes index and footer, then drops the journal; safe to call twice.
+    void close();
+
+private:
+    std::string m_path;
+    std::string m_journalPath;
+    std::fstream m_file;
+    std::vector<ArchiveEntry> m_entries; // previous entries, then the appended ones
+    std::uint64_t m_end = 0;
+    std::vector<std::uint8_t> m_scratch;
+};
+
+std::vector<ArchiveEntry> listArchive(const std::string& path);
+// Decodes one entry from a memory-mapped view of its byte range.
+RawImageData extractFromArchive(const std::string& path, const ArchiveEntry& entry);
+// barch::verify() on a memory-mapped view of one entry; never throws.
+VerifyResult verifyArchiveEntry(const std::string& path, const ArchiveEntry& entry);
+// Copies one entry's encoded bytes out of the mapped archive into `out`.
+void readArchiveEntry(const std::string& path, const ArchiveEntry& entry, std::vector<std::uint8_t>& out);
+
+} // namespace barch
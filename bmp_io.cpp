@@ -1,11 +1,13 @@
 #include "bmp_io.h"
+#include "gray_rows.h"
 #include <fstream>
 #include <vector>
 #include <cstring>
 #include <stdexcept>
 #include <cstdint>
 #include <cstdlib>
-#include <qDebug>
+#include <algorithm>
+#include <QDebug>
 
 #pragma pack(push,1)
 struct BMPHeader
@@ -33,72 +35,169 @@ struct BMPInfoHeader
 #pragma pack(pop)
 
 static inline uint32_t alignUp(uint32_t v, uint32_t a) { return ((v + a - 1) / a) * a; }
+static inline uint32_t readLE32(const std::uint8_t* p)
+{
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
 
-RawImageData loadGrayBMP(const std::string& path)
+constexpr uint32_t kBI_RGB = 0;
+constexpr uint32_t kBI_BITFIELDS = 3;
+
+BMPInfo peekBMPInfo(const std::string& path)
 {
     std::ifstream f(path, std::ios::binary);
     if (!f)
     {
-        qDebug() << "loadGrayBMP: cannot open";
-        throw std::runtime_error("loadGrayBMP: cannot open");
+        qDebug() << "peekBMPInfo: cannot open";
+        throw std::runtime_error("peekBMPInfo: cannot open");
     }
     BMPHeader hdr{}; BMPInfoHeader info{};
     f.read(reinterpret_cast<char*>(&hdr), sizeof(hdr));
     f.read(reinterpret_cast<char*>(&info), sizeof(info));
     if (!f)
+    {
+        qDebug() << "peekBMPInfo: header read failed";
+        throw std::runtime_error("peekBMPInfo: header read failed");
+    }
+    if (hdr.bfType != 0x4D42)
+    {
+        qDebug() << "peekBMPInfo: not BMP";
+        throw std::runtime_error("peekBMPInfo: not BMP");
+    }
+
+    BMPInfo out;
+    out.width       = info.biWidth;
+    out.height      = std::abs(info.biHeight);
+    out.bitCount    = info.biBitCount;
+    out.compression = info.biCompression;
+    return out;
+}
+
+RawImageData decodeGrayBMP(const std::uint8_t* bytes, std::size_t size)
+{
+    BMPHeader hdr{}; BMPInfoHeader info{};
+    if (!bytes || size < sizeof(hdr) + sizeof(info))
     {
         qDebug() << "loadGrayBMP: header read failed";
         throw std::runtime_error("loadGrayBMP: header read failed");
     }
+    std::memcpy(&hdr, bytes, sizeof(hdr));
+    std::memcpy(&info, bytes + sizeof(hdr), sizeof(info));
 
     if (hdr.bfType != 0x4D42)
     {
         qDebug() << "loadGrayBMP: not BMP";
         throw std::runtime_error("loadGrayBMP: not BMP");
     }
-    if (info.biBitCount != 8)
+    const int bpp = info.biBitCount;
+    if (bpp != 1 && bpp != 8 && bpp != 24 && bpp != 32)
     {
-        qDebug() << "loadGrayBMP: need 8-bit BMP";
-        throw std::runtime_error("loadGrayBMP: need 8-bit BMP");
+        qDebug() << "loadGrayBMP: need 1, 8, 24 or 32-bit BMP";
+        throw std::runtime_error("loadGrayBMP: need 1, 8, 24 or 32-bit BMP");
     }
-    if (info.biCompression != 0)
+    if (info.biCompression != kBI_RGB && !(bpp == 32 && info.biCompression == kBI_BITFIELDS))
     {
         qDebug() << "loadGrayBMP: compressed BMP not supported";
         throw std::runtime_error("loadGrayBMP: compressed BMP not supported");
     }
+    if (info.biCompression == kBI_BITFIELDS)
+    {
+        // Masks follow a 40-byte header or sit inside a V4/V5 one; same offset.
+        const std::size_t masksAt = sizeof(hdr) + sizeof(info);
+        if (size < masksAt + 12 || readLE32(bytes + masksAt) != 0x00FF0000u
+            || readLE32(bytes + masksAt + 4) != 0x0000FF00u || readLE32(bytes + masksAt + 8) != 0x000000FFu)
+        {
+            qDebug() << "loadGrayBMP: unsupported bitfields";
+            throw std::runtime_error("loadGrayBMP: unsupported bitfields");
+        }
+    }
+    if (info.biWidth <= 0 || info.biHeight == 0)
+    {
+        qDebug() << "loadGrayBMP: invalid dimensions";
+        throw std::runtime_error("loadGrayBMP: invalid dimensions");
+    }
 
     const int W = info.biWidth;
     const int H = std::abs(info.biHeight);
     const bool bottomUp = (info.biHeight > 0);
 
-    const int rowSize = alignUp(W, 4);
+    // Palette entries (BGRA) reduced to gray once, up front.
+    std::uint8_t lut[256];
+    bool identity = true;
+    if (bpp <= 8)
+    {
+        const std::size_t paletteAt = sizeof(hdr) + info.biSize;
+        const std::size_t maxColors = std::size_t(1) << bpp;
+        const std::size_t colors = (info.biClrUsed && info.biClrUsed < maxColors) ? info.biClrUsed : maxColors;
+        for (std::size_t i = 0; i < 256; ++i)
+            lut[i] = static_cast<std::uint8_t>(i);
+        if (paletteAt + colors * 4 <= hdr.bfOffBits && paletteAt + colors * 4 <= size)
+        {
+            for (std::size_t i = 0; i < colors; ++i)
+            {
+                const std::uint8_t* c = bytes + paletteAt + i * 4;
+                lut[i] = gray::luma(c[2], c[1], c[0]);
+                identity = identity && lut[i] == i;
+            }
+        } else if (bpp == 1)
+        {
+            lut[1] = 0xFF;
+        }
+        if (bpp == 1)
+            identity = false;
+    }
 
-    f.seekg(hdr.bfOffBits, std::ios::beg);
-    if (!f)
+    const std::size_t rowSize = alignUp(std::uint32_t(W) * bpp, 32) / 8;
+    const std::size_t rowBytes = (std::size_t(W) * bpp + 7) / 8;
+    const std::size_t need = std::size_t(hdr.bfOffBits) + rowSize * (H - 1) + rowBytes;
+    if (size < need)
     {
-        qDebug() << "loadGrayBMP: seek to pixels failed";
-        throw std::runtime_error("loadGrayBMP: seek to pixels failed");
+        qDebug() << "loadGrayBMP: pixel read failed";
+        throw std::runtime_error("loadGrayBMP: pixel read failed");
     }
 
-    std::vector<unsigned char> buf(W * H);
+    const std::uint8_t* pixels = bytes + hdr.bfOffBits;
+    auto* out = new unsigned char[std::size_t(W) * H];
     for (int y = 0; y < H; ++y)
     {
         int dstRow = bottomUp ? (H - 1 - y) : y;
-        f.read(reinterpret_cast<char*>(&buf[dstRow * W]), W);
-        f.ignore(rowSize - W);
-        if (!f)
+        const std::uint8_t* src = pixels + y * rowSize;
+        unsigned char* dst = out + std::size_t(dstRow) * W;
+        switch (bpp)
         {
-            qDebug() << "loadGrayBMP: pixel read failed";
-            throw std::runtime_error("loadGrayBMP: pixel read failed");
+            case 1:  gray::fromBits(src, dst, W, lut); break;
+            case 8:
+                if (identity)
+                    std::memcpy(dst, src, W);
+                else
+                    gray::fromIndexed(src, dst, W, lut);
+                break;
+            case 24: gray::fromBGR(src, dst, W); break;
+            case 32: gray::fromBGRX(src, dst, W); break;
         }
     }
+    return { W, H, out };
+}
 
-    auto* copy = new unsigned char[buf.size()];
-    std::memcpy(copy, buf.data(), buf.size());
-    return { W, H, copy };
+RawImageData loadGrayBMP(const std::string& path)
+{
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    if (!f)
+    {
+        qDebug() << "loadGrayBMP: cannot open";
+        throw std::runtime_error("loadGrayBMP: cannot open");
+    }
+    std::vector<std::uint8_t> buf(static_cast<std::size_t>(std::max<std::streamoff>(0, f.tellg())));
+    f.seekg(0, std::ios::beg);
+    if (!f.read(reinterpret_cast<char*>(buf.data()), static_cast<std::streamsize>(buf.size())))
+    {
+        qDebug() << "loadGrayBMP: read failed";
+        throw std::runtime_error("loadGrayBMP: read failed");
+    }
+    return decodeGrayBMP(buf.data(), buf.size());
 }
 
-void writeGrayBMP(const std::string& path, const RawImageData& img)
+void encodeGrayBMP(const RawImageData& img, std::vector<std::uint8_t>& out)
 {
     if (img.width <= 0 || img.height <= 0 || !img.data)
         throw std::invalid_argument("writeGrayBMP: invalid image");
@@ -129,25 +228,37 @@ void writeGrayBMP(const std::string& path, const RawImageData& img)
     info.biClrUsed       = 256;
     info.biClrImportant  = 256;
 
-    std::ofstream f(path, std::ios::binary);
-    if (!f)
-        throw std::runtime_error("writeGrayBMP: cannot open for write");
-
-    f.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
-    f.write(reinterpret_cast<const char*>(&info), sizeof(info));
+    out.assign(fileSize, 0);
+    std::uint8_t* p = out.data();
+    std::memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    std::memcpy(p, &info, sizeof(info));
+    p += sizeof(info);
 
     for (int i = 0; i < 256; ++i)
     {
-        unsigned char entry[4] = { (unsigned char)i, (unsigned char)i, (unsigned char)i, 0x00 };
-        f.write(reinterpret_cast<const char*>(entry), 4);
+        p[0] = p[1] = p[2] = (unsigned char)i;
+        p[3] = 0x00;
+        p += 4;
     }
 
-    std::vector<unsigned char> pad(rowSize - W, 0);
+    // padding bytes stay zero from assign()
     for (int y = H - 1; y >= 0; --y)
     {
-        const unsigned char* row = img.data + y * W;
-        f.write(reinterpret_cast<const char*>(row), W);
-        if (rowSize > W)
-            f.write(reinterpret_cast<const char*>(pad.data()), rowSize - W);
+        std::memcpy(p, img.data + y * W, W);
+        p += rowSize;
     }
 }
+
+void writeGrayBMP(const std::string& path, const RawImageData& img)
+{
+    std::vector<std::uint8_t> bytes;
+    encodeGrayBMP(img, bytes);
+
+    std::ofstream f(path, std::ios::binary);
+    if (!f)
+        throw std::runtime_error("writeGrayBMP: cannot open for write");
+    f.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    if (!f)
+        throw std::runtime_error("writeGrayBMP: write failed");
+}
@@ -1,6 +1,23 @@
 #pragma once
 #include <string>
+#include <vector>
+#include <cstdint>
 #include "barch.hpp"
 
+struct BMPInfo
+{
+    int width = 0;
+    int height = 0;
+    int bitCount = 0;
+    std::uint32_t compression = 0;
+};
+
+// Reads only the file and info headers.
+BMPInfo peekBMPInfo(const std::string& path);
 RawImageData loadGrayBMP(const std::string& path);
 void writeGrayBMP(const std::string& path, const RawImageData& img);
+// In-memory variants used by the batch pipeline; `out` is overwritten.
+// Accepts 1, 8, 24 and 32-bit uncompressed BMP and reduces it to 8-bit
+// gray row by row (palette luma for 1/8-bit, BT.601 luma for colour).
+RawImageData decodeGrayBMP(const std::uint8_t* bytes, std::size_t size);
+void encodeGrayBMP(const RawImageData& img, std::vector<std::uint8_t>& out);
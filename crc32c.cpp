@@ -0,0 +1,127 @@
+#include "crc32c.h"
+
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define BARCH_CRC_SSE42 1
+#define BARCH_CRC_TARGET __attribute__((target("sse4.2")))
+#elif defined(_M_X64)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define BARCH_CRC_SSE42 1
+#define BARCH_CRC_TARGET
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define BARCH_CRC_ARM 1
+#endif
+
+namespace crc
+{
+
+namespace {
+
+constexpr std::uint32_t kPoly = 0x82F63B78u;
+
+struct Tables
+{
+    std::uint32_t t[8][256];
+    Tables()
+    {
+        for (std::uint32_t i = 0; i < 256; ++i)
+        {
+            std::uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c >> 1) ^ ((c & 1) ? kPoly : 0);
+            t[0][i] = c;
+        }
+        for (std::uint32_t i = 0; i < 256; ++i)
+            for (int s = 1; s < 8; ++s)
+                t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+    }
+};
+
+std::uint32_t crcTable(const std::uint8_t* p, std::size_t n, std::uint32_t c)
+{
+    static const Tables tables;
+    const auto& t = tables.t;
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        std::uint32_t lo, hi;
+        std::memcpy(&lo, p, 4);
+        std::memcpy(&hi, p + 4, 4);
+        lo ^= c; // slicing-by-8 assumes a little-endian load
+        c = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+          ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    for (; n; --n, ++p)
+        c = (c >> 8) ^ t[0][(c ^ *p) & 0xFF];
+    return c;
+}
+
+#if BARCH_CRC_SSE42
+BARCH_CRC_TARGET std::uint32_t crcHardware(const std::uint8_t* p, std::size_t n, std::uint32_t c)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    std::uint64_t c64 = c;
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        std::uint64_t v;
+        std::memcpy(&v, p, 8);
+        c64 = _mm_crc32_u64(c64, v);
+    }
+    c = static_cast<std::uint32_t>(c64);
+#endif
+    for (; n >= 4; n -= 4, p += 4)
+    {
+        std::uint32_t v;
+        std::memcpy(&v, p, 4);
+        c = _mm_crc32_u32(c, v);
+    }
+    for (; n; --n, ++p)
+        c = _mm_crc32_u8(c, *p);
+    return c;
+}
+
+bool cpuHasSse42()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int regs[4];
+    __cpuid(regs, 1);
+    return (regs[2] >> 20) & 1;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#elif BARCH_CRC_ARM
+std::uint32_t crcHardware(const std::uint8_t* p, std::size_t n, std::uint32_t c)
+{
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        std::uint64_t v;
+        std::memcpy(&v, p, 8);
+        c = __crc32cd(c, v);
+    }
+    for (; n; --n, ++p)
+        c = __crc32cb(c, *p);
+    return c;
+}
+#endif
+
+} // namespace
+
+std::uint32_t crc32c(const void* data, std::size_t size, std::uint32_t crc)
+{
+    const auto* p = static_cast<const std::uint8_t*>(data);
+    const std::uint32_t c = ~crc;
+#if BARCH_CRC_SSE42
+    static const bool hw = cpuHasSse42();
+    return ~(hw ? crcHardware(p, size, c) : crcTable(p, size, c));
+#elif BARCH_CRC_ARM
+    return ~crcHardware(p, size, c);
+#else
+    return ~crcTable(p, size, c);
+#endif
+}
+
+} // namespace crc
@@ -0,0 +1,15 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// CRC-32C (Castagnoli), as used by iSCSI and ext4: reflected polynomial
+// 0x82F63B78, initial value and final xor 0xFFFFFFFF.
+//
+// Uses the SSE4.2 crc32 instruction when the CPU has it (checked once at
+// run time) or the ARMv8 CRC extension when compiled for it, and a
+// slicing-by-8 table otherwise.
+namespace crc
+{
+// Pass the previous result as `crc` to continue over split buffers.
+std::uint32_t crc32c(const void* data, std::size_t size, std::uint32_t crc = 0);
+} // namespace crc
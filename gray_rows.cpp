@@ -0,0 +1,137 @@
+#include "gray_rows.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BARCH_GRAY_SSE2 1
+#endif
+
+namespace gray
+{
+
+namespace {
+
+#if BARCH_GRAY_SSE2
+// Four BGRX pixels -> four int32 lumas (before rounding shift).
+inline __m128i lumaQuad(__m128i px, __m128i weights)
+{
+    const __m128i zero = _mm_setzero_si128();
+    // per pixel: [B*29 + G*150, R*77 + X*0]
+    const __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), weights);
+    const __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), weights);
+    // fold the two halves of each pixel into lanes 0 and 2
+    const __m128i sumLo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+    const __m128i sumHi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+    return _mm_unpacklo_epi64(_mm_shuffle_epi32(sumLo, _MM_SHUFFLE(3, 1, 2, 0)),
+                              _mm_shuffle_epi32(sumHi, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+#endif
+
+} // namespace
+
+void fromBGRX(const std::uint8_t* src, std::uint8_t* dst, int width)
+{
+    int x = 0;
+#if BARCH_GRAY_SSE2
+    const __m128i weights = _mm_setr_epi16(29, 150, 77, 0, 29, 150, 77, 0);
+    const __m128i round = _mm_set1_epi32(128);
+    for (; x + 8 <= width; x += 8)
+    {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4 + 16));
+        const __m128i ya = _mm_srli_epi32(_mm_add_epi32(lumaQuad(a, weights), round), 8);
+        const __m128i yb = _mm_srli_epi32(_mm_add_epi32(lumaQuad(b, weights), round), 8);
+        const __m128i y16 = _mm_packs_epi32(ya, yb);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(y16, y16));
+    }
+#endif
+    for (; x < width; ++x)
+        dst[x] = luma(src[x * 4 + 2], src[x * 4 + 1], src[x * 4]);
+}
+
+void fromBGR(const std::uint8_t* src, std::uint8_t* dst, int width)
+{
+    // Straight-line body the compiler can vectorise; 3-byte stride rules
+    // out a simple hand-written SSE2 load.
+    for (int x = 0; x < width; ++x)
+        dst[x] = luma(src[x * 3 + 2], src[x * 3 + 1], src[x * 3]);
+}
+
+void fromBits(const std::uint8_t* src, std::uint8_t* dst, int width, const std::uint8_t lut[2])
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        const std::uint8_t bits = src[x >> 3];
+        for (int k = 0; k < 8; ++k)
+            dst[x + k] = lut[(bits >> (7 - k)) & 1];
+    }
+    for (; x < width; ++x)
+        dst[x] = lut[(src[x >> 3] >> (7 - (x & 7))) & 1];
+}
+
+void fromIndexed(const std::uint8_t* src, std::uint8_t* dst, int width, const std::uint8_t lut[256])
+{
+    for (int x = 0; x < width; ++x)
+        dst[x] = lut[src[x]];
+}
+
+void snapBlocks(const std::uint8_t* src, std::uint8_t* dst, int width, int height, int block,
+                std::uint8_t white, std::uint8_t black)
+{
+#if BARCH_GRAY_SSE2
+    // SSE2 has no unsigned byte compare; v >= t  <=>  max(v, t) == v.
+    const __m128i w = _mm_set1_epi8(static_cast<char>(white));
+    const __m128i b = _mm_set1_epi8(static_cast<char>(black));
+    const __m128i ones = _mm_set1_epi8(-1);
+    // Per-byte compare result -> all ones across every block whose bytes
+    // all passed: 32-bit lanes are 4-pixel blocks, pairs of lanes 8-pixel
+    // ones, the whole register a 16-pixel one.
+    auto wholeBlocks = [block, ones](__m128i m) {
+        m = _mm_cmpeq_epi32(m, ones);
+        if (block >= 8)
+            m = _mm_and_si128(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+        if (block >= 16)
+            m = _mm_and_si128(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+        return m;
+    };
+    const bool simd = (block == 4 || block == 8 || block == 16);
+#endif
+    for (int y = 0; y < height; ++y)
+    {
+        const std::uint8_t* s = src + std::size_t(y) * width;
+        std::uint8_t* d = dst + std::size_t(y) * width;
+        int x = 0;
+#if BARCH_GRAY_SSE2
+        // 16 pixels (one to four whole blocks) per step, without branches.
+        for (; simd && x + 16 <= width; x += 16)
+        {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + x));
+            const __m128i toWhite = wholeBlocks(_mm_cmpeq_epi8(_mm_max_epu8(v, w), v));
+            const __m128i toBlack = wholeBlocks(_mm_cmpeq_epi8(_mm_min_epu8(v, b), v));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + x), _mm_andnot_si128(toBlack, _mm_or_si128(v, toWhite)));
+        }
+#endif
+        for (; x < width; x += block)
+        {
+            const int n = std::min(block, width - x);
+            bool allWhite = true;
+            bool allBlack = true;
+            for (int k = 0; k < n; ++k)
+            {
+                allWhite &= (s[x + k] >= white);
+                allBlack &= (s[x + k] <= black);
+            }
+            if (allWhite)
+                std::memset(d + x, 0xFF, std::size_t(n));
+            else if (allBlack)
+                std::memset(d + x, 0x00, std::size_t(n));
+            else if (d != s)
+                std::memcpy(d + x, s + x, std::size_t(n));
+        }
+    }
+}
+
+} // namespace gray
@@ -0,0 +1,30 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// Row converters from packed source pixels to 8-bit gray, used by the
+// ingest paths so no full-colour intermediate image is ever built.
+// Luma uses BT.601 weights in 8.8 fixed point.
+namespace gray
+{
+// 4 bytes per pixel, B G R X order (BMP 32-bit and QImage::Format_RGB32).
+void fromBGRX(const std::uint8_t* src, std::uint8_t* dst, int width);
+// 3 bytes per pixel, B G R order (BMP 24-bit).
+void fromBGR(const std::uint8_t* src, std::uint8_t* dst, int width);
+// 1 bit per pixel, MSB first; lut holds the gray value of index 0 and 1.
+void fromBits(const std::uint8_t* src, std::uint8_t* dst, int width, const std::uint8_t lut[2]);
+// 1 byte per pixel palette index.
+void fromIndexed(const std::uint8_t* src, std::uint8_t* dst, int width, const std::uint8_t lut[256]);
+// Lossy clean-up of scanner noise, one block of `block` pixels at a time
+// (blocks start at x = 0 on every row; the last one may be shorter): a
+// block whose values are all >= white becomes 0xFF, one whose values are
+// all <= black becomes 0x00, any other block is copied unchanged. Rows are
+// `width` pixels, packed. Requires black < white; src == dst is allowed.
+void snapBlocks(const std::uint8_t* src, std::uint8_t* dst, int width, int height, int block,
+                std::uint8_t white, std::uint8_t black);
+
+inline std::uint8_t luma(std::uint8_t r, std::uint8_t g, std::uint8_t b)
+{
+    return static_cast<std::uint8_t>((77u * r + 150u * g + 29u * b + 128u) >> 8);
+}
+} // namespace gray
@@ -0,0 +1,101 @@
+#include "image_ingest.h"
+#include "bmp_io.h"
+#include "gray_rows.h"
+
+#include <QBuffer>
+#include <QByteArray>
+#include <QImage>
+#include <QImageReader>
+#include <QDebug>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+const std::uint8_t kPngSignature[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+
+bool isPng(const std::uint8_t* bytes, std::size_t size)
+{
+    return size >= sizeof(kPngSignature) && std::memcmp(bytes, kPngSignature, sizeof(kPngSignature)) == 0;
+}
+
+bool isBmp(const std::uint8_t* bytes, std::size_t size)
+{
+    return size >= 2 && bytes[0] == 'B' && bytes[1] == 'M';
+}
+
+void paletteLut(const QImage& img, std::uint8_t lut[256])
+{
+    const QList<QRgb> table = img.colorTable();
+    for (int i = 0; i < 256; ++i)
+    {
+        const QRgb c = i < table.size() ? table[i] : qRgb(i, i, i);
+        lut[i] = gray::luma(qRed(c), qGreen(c), qBlue(c));
+    }
+}
+
+RawImageData decodeGrayPNG(const std::uint8_t* bytes, std::size_t size)
+{
+    const QByteArray data = QByteArray::fromRawData(reinterpret_cast<const char*>(bytes), qsizetype(size));
+    QBuffer buf;
+    buf.setData(data);
+    buf.open(QIODevice::ReadOnly);
+    QImageReader reader(&buf, "png");
+    QImage img = reader.read();
+    if (img.isNull())
+    {
+        qDebug() << "decodeGrayImage: PNG decode failed:" << reader.errorString();
+        throw std::runtime_error("decodeGrayImage: PNG decode failed");
+    }
+
+    // Convert the decoder's native rows in one pass; only exotic formats
+    // (16-bit, RGB888, ...) go through Qt's own gray conversion.
+    switch (img.format())
+    {
+        case QImage::Format_Grayscale8:
+        case QImage::Format_Indexed8:
+        case QImage::Format_Mono:
+            break;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        case QImage::Format_RGB32:
+        case QImage::Format_ARGB32:
+            break;
+#endif
+        default:
+            img = img.convertToFormat(QImage::Format_Grayscale8);
+            break;
+    }
+
+    const int W = img.width();
+    const int H = img.height();
+    std::uint8_t lut[256];
+    if (img.format() == QImage::Format_Indexed8 || img.format() == QImage::Format_Mono)
+        paletteLut(img, lut);
+
+    auto* out = new unsigned char[std::size_t(W) * H];
+    for (int y = 0; y < H; ++y)
+    {
+        const std::uint8_t* src = img.constScanLine(y);
+        unsigned char* dst = out + std::size_t(y) * W;
+        switch (img.format())
+        {
+            case QImage::Format_Grayscale8: std::memcpy(dst, src, W); break;
+            case QImage::Format_Indexed8:   gray::fromIndexed(src, dst, W, lut); break;
+            case QImage::Format_Mono:       gray::fromBits(src, dst, W, lut); break;
+            default:                        gray::fromBGRX(src, dst, W); break;
+        }
+    }
+    return { W, H, out };
+}
+
+} // namespace
+
+RawImageData decodeGrayImage(const std::uint8_t* bytes, std::size_t size)
+{
+    if (bytes && isBmp(bytes, size))
+        return decodeGrayBMP(bytes, size);
+    if (bytes && isPng(bytes, size))
+        return decodeGrayPNG(bytes, size);
+    qDebug() << "decodeGrayImage: unknown image format";
+    throw std::runtime_error("decodeGrayImage: unknown image format");
+}
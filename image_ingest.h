@@ -0,0 +1,9 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include "barch.hpp"
+
+// Decodes any supported source (1/8/24/32-bit BMP, PNG) straight into
+// 8-bit gray ready for barch::encode. The format is sniffed from the
+// leading bytes, not the file name. Free the result with barch::freeImage.
+RawImageData decodeGrayImage(const std::uint8_t* bytes, std::size_t size);
@@ -4,14 +4,21 @@
 #include <QDir>
 #include <QFileInfo>
 #include <QStringList>
+#include <QCommandLineParser>
+#include <QDirIterator>
+#include <QTextStream>
+#include <QDebug>
 
 #include "FileListModel.h"
+#include "BarchImageProvider.h"
+#include "JobStats.h"
+#include "barch_archive.h"
 
 static QString resolveStartDir(QStringList args)
 {
-    if (args.size() >= 2)
+    if (args.size() >= 1)
     {
-        QString path = args.at(1);
+        QString path = args.at(0);
         QFileInfo fi(path);
         if (fi.exists() && fi.isDir())
         {
@@ -21,18 +28,106 @@ static QString resolveStartDir(QStringList args)
     return QDir::currentPath();
 }
 
+static bool report(QTextStream& out, const QString& name, const VerifyResult& res)
+{
+    if (!res.ok)
+        out << "FAIL " << name << ": " << QString::fromStdString(res.error) << Qt::endl;
+    else if (res.checksummed)
+        out << "OK   " << name << " (" << res.bands << " bands)" << Qt::endl;
+    else
+        out << "OK   " << name << " (no checksums, sizes only)" << Qt::endl;
+    return res.ok;
+}
+
+// Checks every .barch file and .barx entry under `paths` without decoding
+// pixels. Returns the process exit code: 0 when all are intact.
+static int runVerify(const QStringList& paths)
+{
+    QStringList files;
+    for (const QString& path : paths.isEmpty() ? QStringList{ QDir::currentPath() } : paths)
+    {
+        if (!QFileInfo(path).isDir())
+        {
+            files << path;
+            continue;
+        }
+        QDirIterator it(path, { "*.barch", "*.barx" }, QDir::Files, QDirIterator::Subdirectories);
+        while (it.hasNext())
+            files << it.next();
+    }
+
+    QTextStream out(stdout);
+    int failed = 0;
+    for (const QString& file : files)
+    {
+        if (!file.endsWith(QStringLiteral(".barx"), Qt::CaseInsensitive))
+        {
+            failed += !report(out, file, barch::verify(file.toStdString()));
+            continue;
+        }
+        try {
+            for (const barch::ArchiveEntry& e : barch::listArchive(file.toStdString()))
+            {
+                const QString name = file + '#' + QString::fromStdString(e.name);
+                failed += !report(out, name, barch::verifyArchiveEntry(file.toStdString(), e));
+            }
+        } catch (const std::exception& e) {
+            out << "FAIL " << file << ": " << e.what() << Qt::endl;
+            ++failed;
+        }
+    }
+    out << files.size() << " files checked, " << failed << " failed" << Qt::endl;
+    return failed ? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
+    // Verification is a console mode; it must not need a display.
+    for (int i = 1; i < argc; ++i)
+    {
+        if (qstrcmp(argv[i], "--verify") != 0)
+            continue;
+        QCoreApplication app(argc, argv);
+        QCommandLineParser parser;
+        parser.addHelpOption();
+        parser.addOption(QCommandLineOption("verify", "Check .barch files and .barx archives for corruption."));
+        parser.addPositionalArgument("paths", "Files or directories to check (recursively).", "[paths...]");
+        parser.process(app);
+        return runVerify(parser.positionalArguments());
+    }
+
     QGuiApplication app(argc, argv);
     QCoreApplication::setOrganizationName("Demo");
     QCoreApplication::setApplicationName("qmlBarch");
 
-    QString startDir = resolveStartDir(QCoreApplication::arguments());
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addPositionalArgument("dir", "Directory to open.", "[dir]");
+    QCommandLineOption cpuOpt("cpu-threads", "Threads for encoding/decoding (saved).", "n");
+    QCommandLineOption ioOpt("io-threads", "Threads for file reads/writes (saved).", "n");
+    QCommandLineOption traceOpt("trace", "Write per-stage trace events (Chrome JSON) to <file>.", "file");
+    parser.addOption(cpuOpt);
+    parser.addOption(ioOpt);
+    QCommandLineOption verifyOpt("verify", "Check the given .barch/.barx files or directories and exit.");
+    parser.addOption(traceOpt);
+    parser.addOption(verifyOpt); // handled above, listed for --help
+    parser.process(app);
+
+    if (parser.isSet(traceOpt) && !stats::TraceLog::instance().open(parser.value(traceOpt).toStdString()))
+        qWarning() << "cannot open trace file" << parser.value(traceOpt);
+
+    QString startDir = resolveStartDir(parser.positionalArguments());
 
     FileListModel model;
+    if (parser.isSet(cpuOpt) || parser.isSet(ioOpt))
+    {
+        model.setThreadLimits(parser.isSet(cpuOpt) ? parser.value(cpuOpt).toInt() : model.cpuThreads(),
+                              parser.isSet(ioOpt) ? parser.value(ioOpt).toInt() : model.ioThreads());
+    }
     model.setDirectory(startDir);
 
     QQmlApplicationEngine engine;
+    engine.addImageProvider(QStringLiteral("barch"), new BarchImageProvider);
     engine.rootContext()->setContextProperty("fileModel", &model);
     engine.rootContext()->setContextProperty("startDir", startDir);
 
@@ -44,5 +139,7 @@ int main(int argc, char *argv[])
     }, Qt::QueuedConnection);
     engine.load(url);
 
-    return app.exec();
+    const int rc = app.exec();
+    stats::TraceLog::instance().close();
+    return rc;
 }